@@ -0,0 +1,164 @@
+/** \file layout_benchmark.cpp
+ * Times the gather-heavy grid kernels with every Array2 layout (see
+ * array2_layouts.hpp) on an n by n grid:
+ *  advect   the semi-Lagrangian backtrace of Simulation::advect_velocity, an
+ *           rk4 trace and a bilinear lookup for every face of u and v
+ *  gather   a bilinear lookup of phi at one particle per cell, in random
+ *           order, as correct_levelset does for the particles of a fluid
+ *  batched  the same lookups with one call of Array2::values_at
+ *  stencil  an upwind gradient of every cell, in row-major order, the
+ *           access pattern that favours the row-major layouts
+ * along with the storage of u relative to its cells, the padding the layout
+ * adds to the n + 1 by n grid.
+ *
+ * usage: gfm_layout_benchmark [-n 2048] [-r repeats]
+ *  -n  cells per side (default 2048)
+ *  -r  runs per measurement, the fastest one is reported (default 3)
+ */
+#include "array2.hpp"
+#include "calculus.hpp"
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+template <class F> double fastest_ms(int repeats, F &&kernel) {
+  double best = 0;
+  for (int r = 0; r < repeats; r++) {
+    auto start = std::chrono::high_resolution_clock::now();
+    kernel();
+    auto end = std::chrono::high_resolution_clock::now();
+    double ms = std::chrono::duration<double>(end - start).count() * 1e3;
+    best = (r == 0) ? ms : std::min(best, ms);
+  }
+  return best;
+}
+
+struct Timings {
+  double advect = 0, gather = 0, batched = 0, stencil = 0;
+  double storage = 0;  // elements allocated for u per cell of u
+  double checksum = 0; // the layouts must agree on this
+};
+
+template <class Layout>
+Timings run(int n, int repeats, std::vector<vec2> const &particles) {
+  float h = 1.f / n;
+  Array2<float, Layout> u(n + 1, n, 0, -0.5, h);
+  Array2<float, Layout> v(n, n + 1, -0.5, 0, h);
+  Array2<float, Layout> phi(n, n, -0.5, -0.5, h);
+  /* a vortex around the center, and the level set of a circle */
+  u.for_each_ij([&](int i, int j) {
+    vec2 wp = u.worldspace_of(i, j);
+    u.unchecked(i, j) = -(wp.y - 0.5f);
+  });
+  v.for_each_ij([&](int i, int j) {
+    vec2 wp = v.worldspace_of(i, j);
+    v.unchecked(i, j) = wp.x - 0.5f;
+  });
+  phi.for_each_ij([&](int i, int j) {
+    phi.unchecked(i, j) = length(phi.worldspace_of(i, j) - vec2(0.5)) - 0.3f;
+  });
+
+  Timings t;
+  t.storage = static_cast<double>(u.data.size()) / u.size();
+  Array2<float, Layout> new_u(u), new_v(v), gradient(phi);
+  BasicVelocityField<Array2<float, Layout>> vel(&u, &v);
+  float dt = 3 * h; // backtraces of about one cell
+  t.advect = fastest_ms(repeats, [&] {
+    new_u.for_each_ij([&](int i, int j) {
+      vec2 position = rk4(new_u.worldspace_of(i, j), vel, -dt);
+      new_u.unchecked(i, j) = u.value_at(position);
+    });
+    new_v.for_each_ij([&](int i, int j) {
+      vec2 position = rk4(new_v.worldspace_of(i, j), vel, -dt);
+      new_v.unchecked(i, j) = v.value_at(position);
+    });
+  });
+
+  double gathered = 0;
+  t.gather = fastest_ms(repeats, [&] {
+    gathered = 0;
+    for (vec2 position : particles)
+      gathered += phi.value_at(position);
+  });
+
+  std::vector<float> samples(particles.size());
+  std::vector<float> particle_x, particle_y;
+  for (vec2 position : particles) {
+    particle_x.push_back(position.x);
+    particle_y.push_back(position.y);
+  }
+  t.batched = fastest_ms(repeats, [&] {
+    phi.values_at(particle_x.data(), particle_y.data(), samples.data(),
+                  particles.size());
+  });
+  for (float sample : samples)
+    gathered -= sample; // cancels the scalar gather up to rounding
+
+  t.stencil = fastest_ms(repeats, [&] {
+    phi.for_each_split(
+        [&](int i, int j) {
+          vec2 velocity(u.unchecked(i, j), v.unchecked(i, j));
+          float center = phi.unchecked(i, j);
+          float dx = velocity.x > 0 ? center - phi.unchecked(i - 1, j)
+                                    : phi.unchecked(i + 1, j) - center;
+          float dy = velocity.y > 0 ? center - phi.unchecked(i, j - 1)
+                                    : phi.unchecked(i, j + 1) - center;
+          gradient.unchecked(i, j) = (dx + dy) / h;
+        },
+        [&](int i, int j) { gradient.unchecked(i, j) = 0; });
+  });
+
+  t.checksum = gathered;
+  new_u.for_each_ij([&](int i, int j) { t.checksum += new_u.unchecked(i, j); });
+  gradient.for_each_ij(
+      [&](int i, int j) { t.checksum += 1e-6 * gradient.unchecked(i, j); });
+  return t;
+}
+
+void report(char const *name, Timings const &t, Timings const &dense) {
+  printf("%-12s %9.1f %6.2fx %9.1f %6.2fx %9.1f %6.2fx %9.1f %6.2fx %7.3f"
+         "  %.6e\n",
+         name, t.advect, dense.advect / t.advect, t.gather,
+         dense.gather / t.gather, t.batched, dense.gather / t.batched,
+         t.stencil, dense.stencil / t.stencil, t.storage, t.checksum);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int n = 2048;
+  int repeats = 3;
+  for (int a = 1; a < argc; a++) {
+    std::string arg = argv[a];
+    if (arg == "-n" && a + 1 < argc)
+      n = std::max(8, std::stoi(argv[++a]));
+    else if (arg == "-r" && a + 1 < argc)
+      repeats = std::max(1, std::stoi(argv[++a]));
+    else {
+      printf("usage: %s [-n 2048] [-r repeats]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  std::vector<vec2> particles(static_cast<size_t>(n) * n);
+  for (auto &p : particles)
+    p = vec2(unit(random), unit(random));
+
+  printf("%i x %i cells, times in ms (speedup over dense rows, for batched "
+         "over the scalar dense gather)\n",
+         n, n);
+  printf("%-12s %17s %17s %17s %17s %7s  %s\n", "layout", "advect", "gather",
+         "batched", "stencil", "storage", "checksum");
+  Timings dense = run<DenseRows>(n, repeats, particles);
+  report("dense", dense, dense);
+  report("aligned", run<AlignedRows<>>(n, repeats, particles), dense);
+  report("tiled 8x8", run<Tiled<8>>(n, repeats, particles), dense);
+  report("morton 32x32", run<Morton<>>(n, repeats, particles), dense);
+  return 0;
+}
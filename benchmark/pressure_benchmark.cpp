@@ -0,0 +1,117 @@
+/** \file pressure_benchmark.cpp
+ * Times every pressure solver backend on the systems of saved snapshots (see
+ * snapshot.hpp, written by a run with "save_snapshots": true), at several
+ * resolutions of the same scene.
+ *
+ * usage: gfm_benchmark [-s 1,2,4] [-b cg,mgpcg,...] [-r repeats] snapshots...
+ *  -s  resolutions, as multiples of the saved one (default 1,2)
+ *  -b  backends, as named in config.json (default all of them)
+ *  -r  solves per measurement, the fastest one is reported (default 3)
+ *
+ * For every system and backend this prints the setup time (the layout, matrix
+ * pattern or multigrid hierarchy built once per simulation), the time of one
+ * solve, its iterations and residual, and the residual history: the residual
+ * reached when the same solve is cut off after 1, 2, 4, ... iterations.
+ */
+#include "simulation.hpp"
+#include "snapshot.hpp"
+#include <chrono>
+#include <sstream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::vector<std::string> split(std::string const &list) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    items.push_back(item);
+  return items;
+}
+
+void benchmark(std::string const &path, int scale, PressureSolverType type,
+               int repeats) {
+  Simulation sim;
+  float dt = load_pressure_snapshot(sim, path, scale);
+  if (dt == 0) {
+    printf("~~ could not read snapshot %s\n", path.c_str());
+    return;
+  }
+  SolveMetrics metrics;
+  sim.on_pressure_solve = [&](SolveMetrics const &m) { metrics = m; };
+  sim.solver_settings.type = type;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  sim.initialize_pressure_system();
+  auto end = std::chrono::high_resolution_clock::now();
+  double setup_ms = std::chrono::duration<double>(end - start).count() * 1e3;
+
+  double solve_ms = 0;
+  for (int r = 0; r < repeats; r++) {
+    sim.solve_pressure(dt);
+    double ms = metrics.solve_seconds * 1e3;
+    solve_ms = (r == 0) ? ms : std::min(solve_ms, ms);
+  }
+  SolveMetrics full = metrics;
+  printf("%-24s %5i %8i  %-14s %9.2f %9.2f %6i%s %10.2e\n", path.c_str(),
+         scale, full.unknowns, pressure_solver_name(full.type).c_str(),
+         setup_ms, solve_ms, full.iterations, full.reached_cap ? "*" : " ",
+         full.error);
+
+  /* every solve starts from zero, so cutting it off earlier gives the
+   * residual it had reached at that point. The limit counts refinements for
+   * mixed_cg, whose iterations are those of its inner solves. */
+  printf("    residual history:");
+  for (int cap = 1; cap < full.max_iterations; cap *= 2) {
+    sim.solver_settings.max_iterations = cap;
+    sim.solve_pressure(dt);
+    if (metrics.error <= full.error)
+      break;
+    printf(" %i:%.1e", cap, metrics.error);
+  }
+  printf(" full:%.1e\n", full.error);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<std::string> scales = {"1", "2"};
+  std::vector<std::string> solvers = {"cg",       "mic_cg",         "multigrid",
+                                      "mgpcg",    "matrix_free_cg", "mixed_cg",
+                                      "parallel_cg", "sor",         "fft",
+                                      "ldlt"};
+  int repeats = 3;
+  std::vector<std::string> snapshots;
+  for (int a = 1; a < argc; a++) {
+    std::string arg = argv[a];
+    if (arg == "-s" && a + 1 < argc)
+      scales = split(argv[++a]);
+    else if (arg == "-b" && a + 1 < argc)
+      solvers = split(argv[++a]);
+    else if (arg == "-r" && a + 1 < argc)
+      repeats = std::max(1, std::stoi(argv[++a]));
+    else
+      snapshots.push_back(arg);
+  }
+  if (snapshots.empty()) {
+    printf("usage: %s [-s 1,2,4] [-b cg,mgpcg,...] [-r repeats] "
+           "snapshots...\n",
+           argv[0]);
+    return 1;
+  }
+
+  printf("%-24s %5s %8s  %-14s %9s %9s %7s %10s\n", "snapshot", "scale",
+         "unknowns", "solver", "setup ms", "solve ms", "iters", "residual");
+  for (auto &path : snapshots) {
+    for (auto &scale : scales) {
+      for (auto &solver : solvers)
+        benchmark(path, std::stoi(scale), pressure_solver_from_string(solver),
+                  repeats);
+    }
+  }
+  printf("(* stopped at the iteration limit)\n");
+  return 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <new>
+
+/** \class AlignedAllocator
+ * A std::allocator replacement whose allocations start on an Alignment byte
+ * boundary, 64 by default: a cache line, and the width of an AVX-512
+ * register. Array2 keeps its data in a vector using it, so that rows
+ * starting on a multiple of the alignment can be read with aligned loads.
+ */
+template <class T, std::size_t Alignment = 64> struct AlignedAllocator {
+  static_assert(Alignment >= alignof(T) && (Alignment & (Alignment - 1)) == 0,
+                "the alignment must be a power of two no smaller than T's");
+
+  typedef T value_type;
+
+  template <class U> struct rebind {
+    typedef AlignedAllocator<U, Alignment> other;
+  };
+
+  AlignedAllocator() noexcept {}
+  template <class U>
+  AlignedAllocator(AlignedAllocator<U, Alignment> const &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(
+        ::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+  }
+
+  void deallocate(T *pointer, std::size_t) noexcept {
+    ::operator delete(pointer, std::align_val_t(Alignment));
+  }
+};
+
+template <class T, class U, std::size_t Alignment>
+bool operator==(AlignedAllocator<T, Alignment> const &,
+                AlignedAllocator<U, Alignment> const &) {
+  return true;
+}
+
+template <class T, class U, std::size_t Alignment>
+bool operator!=(AlignedAllocator<T, Alignment> const &,
+                AlignedAllocator<U, Alignment> const &) {
+  return false;
+}
@@ -1,7 +1,10 @@
 #pragma once
 
+#include "aligned_allocator.hpp"
+#include "array2_layouts.hpp"
 #include <algorithm>
 #include <glm/glm.hpp>
+#include <type_traits>
 #include <vector>
 
 using namespace glm;
@@ -12,31 +15,50 @@ using namespace glm;
  * grid. For translation between worldspace and gridspace,
  * we use a linear offset. The leastmost worldspace coordinate considered in our
  * universe is (0,0)
+ *
+ * The data starts on a 64 byte boundary and the Layout (see
+ * array2_layouts.hpp) places the cells in it: DenseRows (the default, row j
+ * at data[sx * j]), AlignedRows, Tiled or Morton. Only DenseRows has no
+ * padding, so the flat index of operator()(int), ij_from_index and the
+ * iterators is only available with it, and loops over the cells of the other
+ * layouts use for_each_ij or for_each_split. set, clamp and the reductions
+ * visit the cells alone with any layout.
  */
-template <class T> struct Array2 {
+template <class T, class Layout = DenseRows> struct Array2 {
 public:
+  typedef std::vector<T, AlignedAllocator<T>> Storage;
+
   int sx = 0;
   int sy = 0;
+  int pitch = 0; // size parameter of the layout, the row length for rows
   float offset_x = 0;
   float offset_y = 0;
   float h = 0;
-  std::vector<T> data;
+  Storage data;
 
   /** \class Array2::iterator
    *  iterates through our data vecot
-   *  call ij() on the iterate to get the index
+   *  call ij() on the iterate to get the index. ij() divides by sx for every
+   *  element and returns float indices, loops that need the indices should
+   *  use for_each_ij instead
    */
-  class iterator : public std::vector<T>::iterator {
+  class iterator : public Storage::iterator {
   public:
-    Array2<T> const *owner;
-    iterator(Array2<T> const *owner, typename std::vector<T>::iterator iter)
-        : std::vector<T>::iterator(iter), owner(owner) {}
-    using std::vector<T>::iterator::operator++;
+    Array2 const *owner;
+    iterator(Array2 const *owner, typename Storage::iterator iter)
+        : Storage::iterator(iter), owner(owner) {}
+    using Storage::iterator::operator++;
     vec2 ij() { return owner->ij_from_index(*this - owner->data.begin()); }
     vec2 wp() { return owner->wp_from_index(*this - owner->data.begin()); }
   };
-  iterator begin() { return iterator(this, data.begin()); }
-  iterator end() { return iterator(this, data.end()); }
+  iterator begin() {
+    static_assert(dense, "the iterators walk the padding of this layout");
+    return iterator(this, data.begin());
+  }
+  iterator end() {
+    static_assert(dense, "the iterators walk the padding of this layout");
+    return iterator(this, data.end());
+  }
 
   int size() const { return sx * sy; }
 
@@ -64,17 +86,17 @@ public:
   void init() {
     assert(sx != 0 && sy != 0);
     assert(h != 0);
-    data = std::vector<T>(sx * sy);
+    pitch = Layout::template pitch<T>(sx, sy);
+    data = Storage(Layout::storage_size(pitch, sx, sy));
     clear();
   }
 
-  /** Fills the data vector with the input value */
+  /** Fills the data vector with the input value, the padding of the layout
+   * included */
   void set(T val) { std::fill(data.begin(), data.end(), val); }
 
   void clamp(T min, T max) {
-    for (auto &d : data) {
-      d = glm::clamp(d, min, max);
-    }
+    for_each_value(*this, [&](T &d) { d = glm::clamp(d, min, max); });
   }
 
   /** Fills the data vector with 0 casted to the template type */
@@ -82,7 +104,13 @@ public:
 
   /** returns direct access to the data vector */
   T &operator()(int i) {
-    assert(i >= 0 && i <= sx * sy);
+    static_assert(dense, "a flat index addresses the padding of this layout");
+    assert(i >= 0 && i < static_cast<int>(data.size()));
+    return data[i];
+  }
+  T const &operator()(int i) const {
+    static_assert(dense, "a flat index addresses the padding of this layout");
+    assert(i >= 0 && i < static_cast<int>(data.size()));
     return data[i];
   }
 
@@ -96,17 +124,75 @@ public:
     j = j > sy - 1 ? sy - 1 : j;
     assert(i >= 0 && i < sx);
     assert(j >= 0 && j < sy);
-    return data[i + (sx * j)];
+    return data[Layout::index(i, j, pitch)];
+  }
+  T const &operator()(int i, int j) const {
+    i = std::clamp(i, 0, sx - 1);
+    j = std::clamp(j, 0, sy - 1);
+    return data[Layout::index(i, j, pitch)];
+  }
+
+  /** The same as (i, j) without clamping, for loops that already know both
+   * indices are in range, such as the interior of for_each_split. Along with
+   * row() this lets the compiler vectorize a stencil. */
+  T &unchecked(int i, int j) {
+    assert(i >= 0 && i < sx && j >= 0 && j < sy);
+    return data[Layout::index(i, j, pitch)];
+  }
+  T const &unchecked(int i, int j) const {
+    assert(i >= 0 && i < sx && j >= 0 && j < sy);
+    return data[Layout::index(i, j, pitch)];
+  }
+
+  /** pointer to the first element of row j, rows are pitch elements apart.
+   * Only for layouts storing rows contiguously. */
+  T *row(int j) {
+    static_assert(Layout::contiguous_rows, "the layout has no rows");
+    return data.data() + pitch * j;
+  }
+  T const *row(int j) const {
+    static_assert(Layout::contiguous_rows, "the layout has no rows");
+    return data.data() + pitch * j;
+  }
+
+  /** Calls f(i, j) for every cell, row by row in storage order */
+  template <class F> void for_each_ij(F &&f) const {
+    for (int j = 0; j < sy; j++) {
+      for (int i = 0; i < sx; i++)
+        f(i, j);
+    }
+  }
+
+  /** Visits every cell, calling interior(i, j) for the cells with all four
+   * neighbors in range, which may therefore be read with unchecked(), and
+   * border(i, j) for the ring of cells along the edge, where they may not.
+   * Rows are visited in order, with the interior of a row in one loop. */
+  template <class Interior, class Border>
+  void for_each_split(Interior &&interior, Border &&border) const {
+    for (int i = 0; i < sx; i++)
+      border(i, 0);
+    for (int j = 1; j < sy - 1; j++) {
+      border(0, j);
+      for (int i = 1; i < sx - 1; i++)
+        interior(i, j);
+      if (sx > 1)
+        border(sx - 1, j);
+    }
+    if (sy > 1) {
+      for (int i = 0; i < sx; i++)
+        border(i, sy - 1);
+    }
   }
 
   /** Takes in a vec2 index of the grid and returns the value stored at that
    * index. Note: this .can. beused with any position in grid coordinates */
   T &operator()(glm::vec2 const ij) { return (*this)(ij.x, ij.y); }
+  T const &operator()(glm::vec2 const ij) const { return (*this)(ij.x, ij.y); }
 
   /** Takes in some position in world coordinates and returns the *grid*
    * coordinates of that position. An example translation is that a
    * center-sampled (eg pressure) value would have offsets -0.5,-0.5   */
-  vec2 coordinates_at(vec2 world_coordinates) {
+  vec2 coordinates_at(vec2 world_coordinates) const {
     assert(!std::isnan(world_coordinates.x) &&
            !std::isnan(world_coordinates.y));
     assert(h != 0);
@@ -133,12 +219,19 @@ public:
                 (grid_coordinates.y - offset_y) * h);
   }
 
+  /** worldspace_of for the integer indices of a cell */
+  vec2 worldspace_of(int i, int j) const {
+    assert(i >= 0 && i < sx && j >= 0 && j < sy);
+    return vec2((i - offset_x) * h, (j - offset_y) * h);
+  }
+
   /** converts from a scalar index (indexing the data vector) to a vec2
    * with x and y coordinates */
   vec2 ij_from_index(int index) const {
-    assert(index >= 0 && index < sx * sy);
-    vec2 ij = vec2(index % sx, index / sx);
-    assert(ij.x + (sx * ij.y) == index); // convert back
+    static_assert(dense, "a flat index addresses the padding of this layout");
+    assert(index >= 0 && index < static_cast<int>(data.size()));
+    vec2 ij = vec2(Layout::ij(index, pitch));
+    assert(Layout::index(ij.x, ij.y, pitch) == index); // convert back
     return ij;
   }
 
@@ -147,31 +240,41 @@ public:
   }
 
   // TODO rearrange this code
-  T max() { return *std::max_element(data.begin(), data.end()); }
-  T min() { return *std::min_element(data.begin(), data.end()); }
-  T infnorm() {
+  T max() const {
+    T best_val = unchecked(0, 0);
+    for_each_value(*this, [&](T d) { best_val = std::max(best_val, d); });
+    return best_val;
+  }
+  T min() const {
+    T best_val = unchecked(0, 0);
+    for_each_value(*this, [&](T d) { best_val = std::min(best_val, d); });
+    return best_val;
+  }
+  T infnorm() const {
     T best_val = 0;
-    for (auto &d : data) {
+    for_each_value(*this, [&](T d) {
       if (std::abs(d) > best_val)
         best_val = std::abs(d);
-    }
+    });
     return best_val;
   }
 
-  inline T lerp(T val1, T val2, float f) {
+  inline T lerp(T val1, T val2, float f) const {
     return (1.0f - f) * val1 + f * val2;
   }
 
-  inline T lerp_2(T val00, T val10, T val01, T val11, vec2 f) {
+  inline T lerp_2(T val00, T val10, T val01, T val11, vec2 f) const {
     return lerp(lerp(val00, val10, f.x), lerp(val01, val11, f.x), f.y);
   }
 
-  inline int index_from_ij(vec2 ij) { return ij.x + (sx * ij.y); }
+  inline int index_from_ij(vec2 ij) const {
+    return Layout::index(ij.x, ij.y, pitch);
+  }
 
   /** The same as (vec2) but it does not interpolate
    * deprecated but i like having it. Note: this forces the coordinates inbound
    */
-  T snapped_access(vec2 ij) {
+  T snapped_access(vec2 ij) const {
     ivec2 rounded(ij);
     int i = rounded.x;
     int j = rounded.y;
@@ -183,20 +286,20 @@ public:
       i = sx - 1;
     if (j > sy - 1)
       j = sy - 1;
-    int index = i + (sx * j);
+    int index = Layout::index(i, j, pitch);
     assert(index >= 0);
-    assert(index < sx * sy);
+    assert(index < static_cast<int>(data.size()));
     return data[index];
   }
 
-  vec2 subcell_coordinates(vec2 ij) {
+  vec2 subcell_coordinates(vec2 ij) const {
     ivec2 rounded(ij);
     return ij - vec2(rounded);
   }
 
   /* bilerp takes in a location (in grid coordinates) and returns the
    * interpolated value at the coordinate*/
-  T const bilerp(vec2 ij) {
+  T bilerp(vec2 ij) const {
     assert(!std::isnan(ij.x) &&
            !std::isnan(ij.y)); // added in the debugging process
     T val00 = snapped_access(ij);
@@ -206,11 +309,65 @@ public:
     return lerp_2(val00, val10, val01, val11, subcell_coordinates(ij));
   }
 
-  T value_at(vec2 world_position) {
+  T value_at(vec2 world_position) const {
     return bilerp(coordinates_at(world_position));
   }
+
+  /** value_at for n points at once, the k-th at world position (x[k], y[k]).
+   * The coordinates come in separate arrays and the loop has no branches,
+   * the clamps being min and max, so that the compiler can vectorize it and
+   * read the four corners with gathers where the target has them. It
+   * multiplies by 1 / h and always takes the next cell as the second one,
+   * where value_at divides by h and snaps ij + 1, so the two agree up to
+   * rounding. */
+  void values_at(float const *x, float const *y, T *values, int n) const {
+    float const inv_h = 1.f / h;
+    float const grid_x = offset_x, grid_y = offset_y;
+    float const last_i = sx - 1, last_j = sy - 1;
+    int const max_i = sx - 1, max_j = sy - 1, stride = pitch;
+    T const *cells = data.data();
+#pragma omp simd
+    for (int k = 0; k < n; k++) {
+      float gx = std::min(std::max(x[k] * inv_h + grid_x, 0.f), last_i);
+      float gy = std::min(std::max(y[k] * inv_h + grid_y, 0.f), last_j);
+      int i0 = static_cast<int>(gx);
+      int j0 = static_cast<int>(gy);
+      int i1 = std::min(i0 + 1, max_i);
+      int j1 = std::min(j0 + 1, max_j);
+      float fx = gx - static_cast<float>(i0);
+      float fy = gy - static_cast<float>(j0);
+      T bottom = (1.f - fx) * cells[Layout::index(i0, j0, stride)] +
+                 fx * cells[Layout::index(i1, j0, stride)];
+      T top = (1.f - fx) * cells[Layout::index(i0, j1, stride)] +
+              fx * cells[Layout::index(i1, j1, stride)];
+      values[k] = (1.f - fy) * bottom + fy * top;
+    }
+  }
+
+private:
+  static constexpr bool dense = std::is_same_v<Layout, DenseRows>;
+
+  /** Calls f on the value of every cell of a, and on nothing else: the
+   * whole storage with DenseRows, a row at a time with other layouts that
+   * have rows, and cell by cell with the rest. */
+  template <class Self, class F> static void for_each_value(Self &a, F &&f) {
+    if constexpr (dense) {
+      for (auto &d : a.data)
+        f(d);
+    } else if constexpr (Layout::contiguous_rows) {
+      for (int j = 0; j < a.sy; j++) {
+        auto *cells = a.row(j);
+        for (int i = 0; i < a.sx; i++)
+          f(cells[i]);
+      }
+    } else {
+      a.for_each_ij([&](int i, int j) { f(a.unchecked(i, j)); });
+    }
+  }
 };
 
 typedef Array2<double> Array2d;
 typedef Array2<float> Array2f;
 typedef Array2<int> Array2i;
+/** the velocities and the pressure, swept a row at a time by SIMD loops */
+typedef Array2<float, AlignedRows<>> AlignedArray2f;
@@ -0,0 +1,83 @@
+#pragma once
+#include <algorithm>
+#include <glm/glm.hpp>
+
+/** \file array2_layouts.hpp
+ * Memory layouts of Array2, chosen by its Layout template parameter. A layout
+ * maps a cell (i, j) to its position in the storage:
+ *   pitch<T>(sx, sy)            a size parameter stored by the array
+ *   storage_size(pitch, sx, sy) number of elements to allocate
+ *   index(i, j, pitch)          storage position of cell (i, j)
+ *   contiguous_rows             whether row j is pitch elements at row(j)
+ * Storage past the sx by sy cells (padding) belongs to no cell. The row
+ * layouts also have ij(index, pitch), the inverse of index, behind
+ * Array2::ij_from_index.
+ */
+
+/** Rows of exactly sx elements, one after another */
+struct DenseRows {
+  static constexpr bool contiguous_rows = true;
+  template <class T> static int pitch(int sx, int sy) { return sx; }
+  static int storage_size(int pitch, int sx, int sy) { return pitch * sy; }
+  static int index(int i, int j, int pitch) { return i + pitch * j; }
+  static glm::ivec2 ij(int index, int pitch) {
+    return glm::ivec2(index % pitch, index / pitch);
+  }
+};
+
+/** Rows padded to a multiple of Bytes. Since the storage itself is aligned,
+ * every row then starts on a Bytes boundary and SIMD loops over a row need no
+ * unaligned head. */
+template <int Bytes = 64> struct AlignedRows : DenseRows {
+  template <class T> static int pitch(int sx, int sy) {
+    int per_line = std::max<int>(1, Bytes / sizeof(T));
+    return (sx + per_line - 1) / per_line * per_line;
+  }
+};
+
+/** Square tiles of Size by Size cells, each stored row-major in one block,
+ * with the tiles in row-major order. A bilinear lookup or a 5 point stencil
+ * then mostly touches one block instead of rows sx elements apart. pitch is
+ * the padded width, a multiple of Size. */
+template <int Size = 8> struct Tiled {
+  static_assert(Size > 0 && (Size & (Size - 1)) == 0,
+                "the tile size must be a power of two");
+  static constexpr bool contiguous_rows = false;
+  template <class T> static int pitch(int sx, int sy) {
+    return (sx + Size - 1) / Size * Size;
+  }
+  static int storage_size(int pitch, int sx, int sy) {
+    return pitch * ((sy + Size - 1) / Size * Size);
+  }
+  static int index(int i, int j, int pitch) {
+    unsigned ui = i, uj = j;
+    return (uj / Size) * (pitch * Size) + (ui / Size) * (Size * Size) +
+           (uj % Size) * Size + ui % Size;
+  }
+};
+
+/** Z-order within Size by Size blocks: the bits of i and j interleaved, so
+ * that cells close in both directions are close in memory at every scale up
+ * to a block, 32 by 32 floats being one 4 KiB page. The blocks are laid out
+ * like the tiles of Tiled, which keeps the storage of a rectangular grid, such
+ * as the n + 1 by n u grid, within a block of its extent instead of the power
+ * of two square around it. */
+template <int Size = 32> struct Morton : Tiled<Size> {
+  static_assert(Size <= (1 << 15), "the block size must fit spread");
+  static int index(int i, int j, int pitch) {
+    unsigned ui = i, uj = j;
+    return (uj / Size) * (pitch * Size) + (ui / Size) * (Size * Size) +
+           (spread(ui % Size) | (spread(uj % Size) << 1));
+  }
+
+private:
+  /** moves bit k of the lower 16 bits of x to bit 2k */
+  static unsigned spread(unsigned x) {
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+  }
+};
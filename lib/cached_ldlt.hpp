@@ -0,0 +1,53 @@
+#pragma once
+#include <algorithm>
+#include <eigen3/Eigen/SparseCholesky>
+#include <eigen3/Eigen/SparseCore>
+#include <vector>
+
+/** \class CachedLDLT
+ * A sparse LDLT factorization that is only redone when a coefficient differs
+ * from the ones last factorized. The pressure system of the ldlt backend keeps
+ * its pattern, so the elimination order and the symbolic analysis are done
+ * once by analyzePattern, and substeps where no interface crossed a face skip
+ * the numerical factorization too.
+ */
+class CachedLDLT {
+public:
+  typedef Eigen::SparseMatrix<double> Matrix;
+
+  int factorizations = 0; // numerical factorizations done, failed ones too
+
+  /** orders and analyzes the pattern of A, forgetting any factorization */
+  void analyzePattern(Matrix const &A) {
+    ldlt.analyzePattern(A);
+    factorized_values.clear();
+  }
+
+  /** Factorizes A unless its values are the ones last factorized. Returns
+   * false if the factorization failed, in which case nothing is cached and
+   * the next call factorizes again. */
+  bool factorize(Matrix const &A) {
+    double const *values = A.valuePtr();
+    int count = A.nonZeros();
+    if (factorized_values.size() == static_cast<size_t>(count) &&
+        std::equal(values, values + count, factorized_values.begin()))
+      return true;
+    ldlt.factorize(A);
+    factorizations++;
+    if (ldlt.info() != Eigen::Success) {
+      factorized_values.clear();
+      return false;
+    }
+    factorized_values.assign(values, values + count);
+    return true;
+  }
+
+  /** x = A^-1 b with the last successful factorization */
+  template <typename Rhs> Eigen::VectorXd solve(Rhs const &b) const {
+    return ldlt.solve(b);
+  }
+
+private:
+  Eigen::SimplicialLDLT<Matrix> ldlt;
+  std::vector<double> factorized_values; // the coefficients last factorized
+};
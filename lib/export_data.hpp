@@ -4,7 +4,8 @@
 #include <iostream>
 #include <vector>
 
-void export_particles(std::vector<Fluid> &sim, float time, int frame_number) {
+void export_particles(std::vector<Fluid> const &sim, float time,
+                      int frame_number) {
   std::fstream part_file("plot/data/part.txt", part_file.out | part_file.app);
   part_file << "#BLOCK HEADER time:" << time << "\n";
   part_file << "#x\ty\tinitial_phi\tradius\n";
@@ -20,7 +21,7 @@ void export_particles(std::vector<Fluid> &sim, float time, int frame_number) {
 }
 
 /* exports velocities sampled at the voxel centers */
-void export_velocity(VelocityField &vel, Array2f phi, float time,
+void export_velocity(VelocityField const &vel, Array2f const &phi, float time,
                      int frame_number) {
   std::fstream vel_file("plot/data/vel.txt", vel_file.out | vel_file.app);
 
@@ -28,12 +29,12 @@ void export_velocity(VelocityField &vel, Array2f phi, float time,
   vel_file << "#x\ty\tu\tv\n";
   vel_file << "\n";
 
-  for (auto it = phi.begin(); it != phi.end(); it++) {
-    vec2 wp = it.wp();
+  phi.for_each_ij([&](int i, int j) {
+    vec2 wp = phi.worldspace_of(i, j);
     vec2 velocity = vel(wp);
     vel_file << wp.x << "\t" << wp.y << "\t" << velocity.x << "\t" << velocity.y
              << "\n";
-  }
+  });
 }
 
 /** we make use of the fact that by our projection method, only one fluid at any
@@ -41,8 +42,8 @@ void export_velocity(VelocityField &vel, Array2f phi, float time,
  * are guaranteed both no overlaps (because at most 1 is negative) and no gaps
  * (because we will never have no gaps).
  * */
-void export_fluid_ids(Array2f &p, std::vector<Fluid> &fluids, float time,
-                      int frame_number) {
+void export_fluid_ids(AlignedArray2f const &p, std::vector<Fluid> const &fluids,
+                      float time, int frame_number) {
   std::fstream fluid_id_file("plot/data/phi.txt",
                              fluid_id_file.out | fluid_id_file.app);
 
@@ -52,20 +53,20 @@ void export_fluid_ids(Array2f &p, std::vector<Fluid> &fluids, float time,
 
   for (int n = 0; n < (int)fluids.size(); n++) {
     auto &f = fluids[n];
-    for (auto it = f.phi.begin(); it != f.phi.end(); it++) {
-      if (*it > 0)
-        continue;
-      vec2 ij = it.ij();
-      vec2 wp = f.phi.worldspace_of(ij);
-      fluid_id_file << wp.x << "\t" << wp.y << "\t" << *it << "\t" << n << "\t"
-                    << p(ij) << "\n";
-    }
+    f.phi.for_each_ij([&](int i, int j) {
+      float phi = f.phi.unchecked(i, j);
+      if (phi > 0)
+        return;
+      vec2 wp = f.phi.worldspace_of(i, j);
+      fluid_id_file << wp.x << "\t" << wp.y << "\t" << phi << "\t" << n << "\t"
+                    << p.unchecked(i, j) << "\n";
+    });
   }
   fluid_id_file.close();
 }
 
-void export_simulation_data(Array2f &p, VelocityField vel,
-                            std::vector<Fluid> &sim, float time,
+void export_simulation_data(AlignedArray2f const &p, VelocityField const &vel,
+                            std::vector<Fluid> const &sim, float time,
                             int frame_number) {
   std::printf("exporting frame %i at time %.2f\n", frame_number, time);
   export_fluid_ids(p, sim, time, frame_number);
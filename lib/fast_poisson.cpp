@@ -0,0 +1,339 @@
+#include "fast_poisson.hpp"
+#include <cmath>
+
+void FFT::init(int n_) {
+  n = n_;
+  bool power_of_two = (n & (n - 1)) == 0;
+  m = 1;
+  while (m < (power_of_two ? n : 2 * n - 1))
+    m *= 2;
+  twiddles.resize(m / 2);
+  for (int k = 0; k < m / 2; k++)
+    twiddles[k] = std::polar(1.0, -2.0 * M_PI * k / m);
+  chirp.clear();
+  kernel.clear();
+  if (power_of_two)
+    return;
+
+  /* k^2 is reduced modulo 2n so that the angle stays accurate */
+  chirp.resize(n);
+  for (long k = 0; k < n; k++)
+    chirp[k] = std::polar(1.0, -M_PI * static_cast<double>((k * k) % (2 * n)) /
+                                   n);
+  kernel.assign(m, Complex(0, 0));
+  kernel[0] = std::conj(chirp[0]);
+  for (int k = 1; k < n; k++)
+    kernel[k] = kernel[m - k] = std::conj(chirp[k]);
+  radix2(kernel);
+}
+
+/** in-place iterative radix-2 transform of length m */
+void FFT::radix2(std::vector<Complex> &a) const {
+  for (int i = 1, j = 0; i < m; i++) {
+    int bit = m >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+      std::swap(a[i], a[j]);
+  }
+  for (int length = 2; length <= m; length *= 2) {
+    int stride = m / length;
+    for (int start = 0; start < m; start += length) {
+      for (int k = 0; k < length / 2; k++) {
+        Complex even = a[start + k];
+        Complex odd = a[start + k + length / 2] * twiddles[k * stride];
+        a[start + k] = even + odd;
+        a[start + k + length / 2] = even - odd;
+      }
+    }
+  }
+}
+
+void FFT::transform(std::vector<Complex> &a, bool inverse,
+                    std::vector<Complex> &scratch) const {
+  /* the inverse transform is the conjugate of the forward transform of the
+   * conjugate */
+  if (inverse) {
+    for (int k = 0; k < n; k++)
+      a[k] = std::conj(a[k]);
+  }
+  if (chirp.empty()) {
+    radix2(a);
+  } else {
+    std::vector<Complex> &u = scratch;
+    u.assign(m, Complex(0, 0));
+    for (int k = 0; k < n; k++)
+      u[k] = a[k] * chirp[k];
+    radix2(u);
+    for (int k = 0; k < m; k++)
+      u[k] = std::conj(u[k] * kernel[k]);
+    radix2(u);
+    for (int k = 0; k < n; k++)
+      a[k] = std::conj(u[k]) * chirp[k] / static_cast<double>(m);
+  }
+  if (inverse) {
+    for (int k = 0; k < n; k++)
+      a[k] = std::conj(a[k]);
+  }
+}
+
+bool FastPoissonSolver::build(Array2f &solid_phi) {
+  int i1 = -1, j1 = -1;
+  i0 = solid_phi.sx;
+  j0 = solid_phi.sy;
+  int count = 0;
+  for (int j = 0; j < solid_phi.sy; j++) {
+    for (int i = 0; i < solid_phi.sx; i++) {
+      if (solid_phi(i, j) <= 0)
+        continue;
+      i0 = std::min(i0, i);
+      j0 = std::min(j0, j);
+      i1 = std::max(i1, i);
+      j1 = std::max(j1, j);
+      count++;
+    }
+  }
+  nx = i1 - i0 + 1;
+  ny = j1 - j0 + 1;
+  if (count == 0 || count != nx * ny)
+    return false;
+
+  fft_x.init(nx);
+  fft_y.init(ny);
+  eigenvalues_x.resize(nx);
+  for (int k = 0; k < nx; k++)
+    eigenvalues_x[k] = 2.0 * std::cos(M_PI * k / nx) - 2.0;
+  eigenvalues_y.resize(ny);
+  for (int k = 0; k < ny; k++)
+    eigenvalues_y[k] = 2.0 * std::cos(M_PI * k / ny) - 2.0;
+  phases_x.resize(nx);
+  for (int k = 0; k < nx; k++)
+    phases_x[k] = std::polar(1.0, -M_PI * k / (2 * nx));
+  phases_y.resize(ny);
+  for (int k = 0; k < ny; k++)
+    phases_y[k] = std::polar(1.0, -M_PI * k / (2 * ny));
+  r.init(solid_phi.sx, solid_phi.sy, -0.5, -0.5, solid_phi.h);
+  z = p = q = r;
+  return true;
+}
+
+/** DCT-II, X_k = sum_i x_i cos(pi k (2i + 1) / 2n), through an FFT of the
+ * same length on the reordered line (even samples forward, then odd samples
+ * backward), see Makhoul, "A fast cosine transform in one and two
+ * dimensions" */
+void FastPoissonSolver::dct(std::vector<double> &line, FFT const &fft,
+                            std::vector<FFT::Complex> const &phases,
+                            std::vector<FFT::Complex> &work,
+                            std::vector<FFT::Complex> &scratch) {
+  int n = line.size();
+  for (int i = 0; 2 * i < n; i++)
+    work[i] = line[2 * i];
+  for (int i = 0; 2 * i + 1 < n; i++)
+    work[n - 1 - i] = line[2 * i + 1];
+  fft.transform(work, false, scratch);
+  for (int k = 0; k < n; k++)
+    line[k] = (phases[k] * work[k]).real();
+}
+
+/** the inverse of dct. Since the reordered line is real,
+ *   exp(-pi i k / 2n) V_k = X_k - i X_(n-k)
+ * gives back its transform V. */
+void FastPoissonSolver::inverse_dct(std::vector<double> &line, FFT const &fft,
+                                    std::vector<FFT::Complex> const &phases,
+                                    std::vector<FFT::Complex> &work,
+                                    std::vector<FFT::Complex> &scratch) {
+  int n = line.size();
+  for (int k = 0; k < n; k++) {
+    double opposite = (k == 0) ? 0.0 : line[n - k];
+    work[k] = std::conj(phases[k]) * FFT::Complex(line[k], -opposite);
+  }
+  fft.transform(work, true, scratch);
+  for (int i = 0; 2 * i < n; i++)
+    line[2 * i] = work[i].real() / n;
+  for (int i = 0; 2 * i + 1 < n; i++)
+    line[2 * i + 1] = work[n - 1 - i].real() / n;
+}
+
+void FastPoissonSolver::transform_rows(Array2d &a, bool inverse) {
+#pragma omp parallel
+  {
+    std::vector<double> line(nx);
+    std::vector<FFT::Complex> work(nx), scratch;
+#pragma omp for schedule(static)
+    for (int j = j0; j < j0 + ny; j++) {
+      for (int i = 0; i < nx; i++)
+        line[i] = a(i0 + i, j);
+      if (inverse)
+        inverse_dct(line, fft_x, phases_x, work, scratch);
+      else
+        dct(line, fft_x, phases_x, work, scratch);
+      for (int i = 0; i < nx; i++)
+        a(i0 + i, j) = line[i];
+    }
+  }
+}
+
+void FastPoissonSolver::transform_columns(Array2d &a, bool inverse) {
+#pragma omp parallel
+  {
+    std::vector<double> line(ny);
+    std::vector<FFT::Complex> work(ny), scratch;
+#pragma omp for schedule(static)
+    for (int i = i0; i < i0 + nx; i++) {
+      for (int j = 0; j < ny; j++)
+        line[j] = a(i, j0 + j);
+      if (inverse)
+        inverse_dct(line, fft_y, phases_y, work, scratch);
+      else
+        dct(line, fft_y, phases_y, work, scratch);
+      for (int j = 0; j < ny; j++)
+        a(i, j0 + j) = line[j];
+    }
+  }
+}
+
+void FastPoissonSolver::apply_inverse(Array2d &b, Array2d &x, double beta) {
+  x.clear();
+  for (int j = j0; j < j0 + ny; j++) {
+    for (int i = i0; i < i0 + nx; i++)
+      x(i, j) = b(i, j);
+  }
+  transform_rows(x, false);
+  transform_columns(x, false);
+  for (int ky = 0; ky < ny; ky++) {
+    for (int kx = 0; kx < nx; kx++) {
+      double eigenvalue = beta * (eigenvalues_x[kx] + eigenvalues_y[ky]);
+      x(i0 + kx, j0 + ky) =
+          (kx == 0 && ky == 0) ? 0 : x(i0 + kx, j0 + ky) / eigenvalue;
+    }
+  }
+  transform_columns(x, true);
+  transform_rows(x, true);
+}
+
+/** out = A * in, the same stencil as MultigridSolver. Faces on the border of
+ * the rectangle are walls whatever their coefficient. */
+void FastPoissonSolver::apply_operator(Array2d &bu, Array2d &bv, Array2d &in,
+                                       Array2d &out) {
+  out.clear();
+#pragma omp parallel for schedule(static)
+  for (int j = j0; j < j0 + ny; j++) {
+    for (int i = i0; i < i0 + nx; i++) {
+      double center = in(i, j);
+      double sum = 0;
+      if (i > i0)
+        sum += bu(i, j) * (in(i - 1, j) - center);
+      if (i < i0 + nx - 1)
+        sum += bu(i + 1, j) * (in(i + 1, j) - center);
+      if (j > j0)
+        sum += bv(i, j) * (in(i, j - 1) - center);
+      if (j < j0 + ny - 1)
+        sum += bv(i, j + 1) * (in(i, j + 1) - center);
+      out(i, j) = sum;
+    }
+  }
+}
+
+double FastPoissonSolver::dot(Array2d &a, Array2d &b) {
+  double sum = 0;
+#pragma omp parallel for schedule(static) reduction(+ : sum)
+  for (int j = j0; j < j0 + ny; j++) {
+    for (int i = i0; i < i0 + nx; i++)
+      sum += a(i, j) * b(i, j);
+  }
+  return sum;
+}
+
+void FastPoissonSolver::solve(Array2d &u_coefficients, Array2d &v_coefficients,
+                              Array2d &b, Array2d &x, double tolerance,
+                              int max_iterations) {
+  /* the faces inside the rectangle, a single density makes them all equal */
+  double sum = 0, smallest = INFINITY, largest = 0;
+  int faces = 0;
+  for (int j = j0; j < j0 + ny; j++) {
+    for (int i = i0; i < i0 + nx; i++) {
+      if (i > i0) {
+        double c = u_coefficients(i, j);
+        sum += c;
+        smallest = std::min(smallest, c);
+        largest = std::max(largest, c);
+        faces++;
+      }
+      if (j > j0) {
+        double c = v_coefficients(i, j);
+        sum += c;
+        smallest = std::min(smallest, c);
+        largest = std::max(largest, c);
+        faces++;
+      }
+    }
+  }
+  double beta = (faces > 0) ? sum / faces : 1.0;
+
+  iterations = 0;
+  double b_norm = std::sqrt(dot(b, b));
+  if (b_norm == 0) {
+    x.clear();
+    error = 0;
+    return;
+  }
+
+  /* remove the constant part of b, which the closed box can't produce */
+  double mean = 0;
+  for (int j = j0; j < j0 + ny; j++) {
+    for (int i = i0; i < i0 + nx; i++)
+      mean += b(i, j);
+  }
+  mean /= nx * ny;
+  for (int j = j0; j < j0 + ny; j++) {
+    for (int i = i0; i < i0 + nx; i++)
+      r(i, j) = b(i, j) - mean;
+  }
+
+  if (largest - smallest <= 1e-6 * largest) {
+    apply_inverse(r, x, beta);
+    apply_operator(u_coefficients, v_coefficients, x, q);
+    for (int j = j0; j < j0 + ny; j++) {
+      for (int i = i0; i < i0 + nx; i++)
+        q(i, j) = r(i, j) - q(i, j);
+    }
+    error = std::sqrt(dot(q, q)) / b_norm;
+    return;
+  }
+
+  /* conjugate gradient preconditioned with the constant coefficient solve */
+  apply_operator(u_coefficients, v_coefficients, x, q);
+  for (int j = j0; j < j0 + ny; j++) {
+    for (int i = i0; i < i0 + nx; i++)
+      r(i, j) -= q(i, j);
+  }
+  error = std::sqrt(dot(r, r)) / b_norm;
+  if (error < tolerance)
+    return;
+  apply_inverse(r, z, beta);
+  p.data = z.data;
+  double rho = dot(r, z);
+  while (iterations < max_iterations) {
+    apply_operator(u_coefficients, v_coefficients, p, q);
+    double alpha = rho / dot(p, q);
+    for (int j = j0; j < j0 + ny; j++) {
+      for (int i = i0; i < i0 + nx; i++) {
+        x(i, j) += alpha * p(i, j);
+        r(i, j) -= alpha * q(i, j);
+      }
+    }
+    iterations++;
+    error = std::sqrt(dot(r, r)) / b_norm;
+    if (error < tolerance)
+      break;
+    apply_inverse(r, z, beta);
+    double rho_new = dot(r, z);
+    double beta_cg = rho_new / rho;
+    rho = rho_new;
+    for (int j = j0; j < j0 + ny; j++) {
+      for (int i = i0; i < i0 + nx; i++)
+        p(i, j) = z(i, j) + beta_cg * p(i, j);
+    }
+  }
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "array2.hpp"
+#include <complex>
+#include <vector>
+
+/** \class FFT
+ * An unnormalized complex FFT of a fixed length. Powers of two use an iterative
+ * radix-2 transform, every other length is turned into a power of two
+ * convolution with Bluestein's algorithm, so any grid size is O(n log n).
+ */
+class FFT {
+public:
+  typedef std::complex<double> Complex;
+
+  void init(int n);
+  int size() const { return n; }
+
+  /** a_k <- sum_m a_m exp(-+2 pi i k m / n), the sign being + if inverse.
+   * scratch is resized as needed, so that it can be reused between calls. */
+  void transform(std::vector<Complex> &a, bool inverse,
+                 std::vector<Complex> &scratch) const;
+
+private:
+  int n = 0;
+  int m = 0;                     // length of the radix-2 transform
+  std::vector<Complex> twiddles; // exp(-2 pi i k / m) for k < m / 2
+  std::vector<Complex> chirp;    // exp(-pi i k^2 / n), Bluestein only
+  std::vector<Complex> kernel;   // transformed conjugate chirp, Bluestein only
+
+  void radix2(std::vector<Complex> &a) const;
+};
+
+/** \class FastPoissonSolver
+ * Solves the constant coefficient poisson equation on a rectangle of cells
+ * with solid walls all around, which the cosine transform (DCT-II) of each
+ * axis diagonalizes:
+ *   A = beta * (L_x + L_y), with eigenvalues (2 cos(pi k / n) - 2) per axis.
+ * A solve is a forward transform, a division by the eigenvalues and an inverse
+ * transform, with the constant mode set to zero.
+ *
+ * When the face coefficients vary (several fluids of different densities), the
+ * same solve with their mean as beta preconditions a conjugate gradient on the
+ * true operator.
+ */
+class FastPoissonSolver {
+public:
+  int iterations = 0; // CG iterations of the last solve, 0 for a direct solve
+  double error = 0;   // relative residual reached by the last solve
+
+  /** Finds the rectangle of active (solid_phi > 0) cells. Returns false if the
+   * active cells do not fill their bounding box, the solver can't be used
+   * then. */
+  bool build(Array2f &solid_phi);
+
+  /** Solves Ax = b for the face coefficient operator of MultigridSolver. If
+   * all coefficients are equal this is a single direct solve, otherwise a
+   * preconditioned CG stopping at |b - Ax| / |b| < tolerance. x holds the
+   * initial guess of the CG on entry. */
+  void solve(Array2d &u_coefficients, Array2d &v_coefficients, Array2d &b,
+             Array2d &x, double tolerance, int max_iterations);
+
+  /** x = (beta (L_x + L_y))^-1 b on the rectangle, without the constant */
+  void apply_inverse(Array2d &b, Array2d &x, double beta);
+
+private:
+  int i0 = 0, j0 = 0, nx = 0, ny = 0; // the rectangle of active cells
+  FFT fft_x, fft_y;                   // of lengths nx and ny
+  std::vector<double> eigenvalues_x, eigenvalues_y;
+  std::vector<FFT::Complex> phases_x, phases_y; // exp(-pi i k / 2n)
+  Array2d r, z, p, q; // conjugate gradient vectors
+
+  void dct(std::vector<double> &line, FFT const &fft,
+           std::vector<FFT::Complex> const &phases,
+           std::vector<FFT::Complex> &work, std::vector<FFT::Complex> &scratch);
+  void inverse_dct(std::vector<double> &line, FFT const &fft,
+                   std::vector<FFT::Complex> const &phases,
+                   std::vector<FFT::Complex> &work,
+                   std::vector<FFT::Complex> &scratch);
+  void transform_rows(Array2d &a, bool inverse);
+  void transform_columns(Array2d &a, bool inverse);
+  void apply_operator(Array2d &bu, Array2d &bv, Array2d &in, Array2d &out);
+  double dot(Array2d &a, Array2d &b);
+};
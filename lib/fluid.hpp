@@ -2,6 +2,7 @@
 #include "array2.hpp"
 #include <algorithm>
 #include <stdio.h>
+#include <vector>
 
 /** \class Particle
  * A simple particle class for use in the particle level set method
@@ -37,11 +38,28 @@ public:
     particle_count.init(sx_, sy_, 0.f, 0.f, h);
   }
   /*    */
-  void print_information() {
+  void print_information() const {
     printf("~~ Fluid information ~~\n density: %.3f\n volume: ~%i%%\n", density,
            (int)(100.f *
                  (float)count_if(phi.data.begin(), phi.data.end(),
                                  [](float f) { return f < 0.f; }) /
                  (float)phi.size()));
   }
-};
\ No newline at end of file
+};
+
+/** Returns the density coefficient of the face between cells (i, j) and
+ * (k, l), either as naively expected in the case where the voxels contain the
+ * same fluid, or as defined in eqn. 55 in Liu et al */
+inline float sample_density(Array2i &fluid_id, std::vector<Fluid> &fluids,
+                            int i, int j, int k, int l) {
+  int ij_id = fluid_id(i, j);
+  int kl_id = fluid_id(k, l);
+  if (ij_id == kl_id)
+    return 1.f / fluids[ij_id].density;
+  float ij_phi = fluids[ij_id].phi(i, j);
+  float kl_phi = fluids[kl_id].phi(k, l);
+  float b_minus = 1.f / fluids[ij_id].density;
+  float b_plus = 1.f / fluids[kl_id].density;
+  float theta = abs(ij_phi) / (abs(ij_phi) + abs(kl_phi));
+  return (b_minus * b_plus) / (theta * b_plus + (1.f - theta) * b_minus);
+}
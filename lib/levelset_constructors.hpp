@@ -41,7 +41,7 @@ struct FluidConfig {
  * p1, p2 are the spheres center
  * p3 is the radius
  */
-float compute_phi_sphere(vec2 p, FluidConfig &fconf) {
+float compute_phi_sphere(vec2 p, FluidConfig const &fconf) {
   return distance(p, vec2(fconf.p1, fconf.p2)) - fconf.p3;
 }
 
@@ -50,7 +50,7 @@ float compute_phi_sphere(vec2 p, FluidConfig &fconf) {
  * p2 is the planes height (upper)
  * p3 is the jitter quantity
  */
-float compute_phi_plane(vec2 p, FluidConfig &fconf) {
+float compute_phi_plane(vec2 p, FluidConfig const &fconf) {
   float midpoint = (fconf.p1 + fconf.p2) * 0.5f;
   float radius = (fconf.p1 - fconf.p2) * 0.5f;
   return abs(p.y - (midpoint + linearRand(-fconf.p3, fconf.p3))) - radius;
@@ -58,17 +58,16 @@ float compute_phi_plane(vec2 p, FluidConfig &fconf) {
 
 /** TODO - add documentation and more level set starting configurations */
 void construct_levelset(Fluid &f, int sx, int sy, float h, std::string name,
-                        std::vector<FluidConfig> fluid_phis) {
+                        std::vector<FluidConfig> const &fluid_phis) {
   f.phi.set((sx + sy) * h);
 
-  for (auto it = f.phi.begin(); it != f.phi.end(); it++) {
-    vec2 ij = it.ij();
+  f.phi.for_each_ij([&](int i, int j) {
     vec2 scaled_position =
-        vec2((static_cast<float>(ij.x) + 0.5f) / static_cast<float>(sx),
-             (static_cast<float>(ij.y) + 0.5f) / static_cast<float>(sy));
+        vec2((static_cast<float>(i) + 0.5f) / static_cast<float>(sx),
+             (static_cast<float>(j) + 0.5f) / static_cast<float>(sy));
     float phi_value = 0;
 
-    for (auto fconf : fluid_phis) {
+    for (auto &fconf : fluid_phis) {
       if (fconf.name == "circle") {
         phi_value = compute_phi_sphere(scaled_position, fconf);
       } else if (fconf.name == "plane") {
@@ -78,9 +77,9 @@ void construct_levelset(Fluid &f, int sx, int sy, float h, std::string name,
                                  : (f.phi.sx + f.phi.sy) * h;
       }
       phi_value = fconf.negate ? -phi_value : phi_value;
-      f.phi(ij) = min(phi_value, f.phi(ij));
+      f.phi.unchecked(i, j) = min(phi_value, f.phi.unchecked(i, j));
     }
-  }
+  });
 }
 
 /** returns the distance from a point to a bounding box */
@@ -97,10 +96,10 @@ float distance_to_bounds(vec2 position, vec2 lower_bounds, vec2 upper_bounds) {
 void fix_levelset_walls(std::vector<Fluid> &fluids, vec2 lower_bounds,
                         vec2 upper_bounds) {
   for (auto &f : fluids) {
-    for (auto it = f.phi.begin(); it != f.phi.end(); it++) {
-      float box_distance =
-          distance_to_bounds(it.wp(), lower_bounds, upper_bounds);
-      *it = max(-box_distance, *it);
-    }
+    f.phi.for_each_ij([&](int i, int j) {
+      float box_distance = distance_to_bounds(f.phi.worldspace_of(i, j),
+                                              lower_bounds, upper_bounds);
+      f.phi.unchecked(i, j) = max(-box_distance, f.phi.unchecked(i, j));
+    });
   }
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "array2.hpp"
 #include "calculus.hpp"
 #include "fluid.hpp"
+#include "scratch_pool.hpp"
 #include <glm/gtc/random.hpp>
 
 using namespace glm;
@@ -11,24 +12,25 @@ using namespace glm;
  *
  * currently adding reactions as an experimental feature
  * */
-void project_phi(std::vector<Fluid> &fluids, Array2f &solid_phi, vec4 rxn) {
+void project_phi(std::vector<Fluid> &fluids, Array2f const &solid_phi,
+                 vec4 rxn) {
   assert(!fluids.empty());
   int number_grid_points = fluids[0].phi.size();
-  for (int i = 0; i < (int)number_grid_points; i++) {
+  fluids[0].phi.for_each_ij([&](int i, int j) {
     float min1 = number_grid_points;
     float min2 = number_grid_points;
     int min1_index = -1;
     int min2_index = -1;
-    for (int j = 0; j < (int)fluids.size(); j++) {
-      auto &f = fluids[j];
-      if (f.phi(i) < min1) {
+    for (int n = 0; n < (int)fluids.size(); n++) {
+      float phi = fluids[n].phi.unchecked(i, j);
+      if (phi < min1) {
         min2 = min1;
         min2_index = min1_index;
-        min1 = f.phi(i);
-        min1_index = j;
-      } else if (f.phi(i) < min2) {
-        min2 = f.phi(i);
-        min2_index = j;
+        min1 = phi;
+        min1_index = n;
+      } else if (phi < min2) {
+        min2 = phi;
+        min2_index = n;
       }
     }
 
@@ -42,36 +44,36 @@ void project_phi(std::vector<Fluid> &fluids, Array2f &solid_phi, vec4 rxn) {
                     min2 < 0.35f * fluids[min2_index].phi.h);
     if (valid_reaction && desired_reactants && overlap) {
       auto &pf = fluids[rxn[2]];
-      pf.phi(i) = min1 - 1.0f * pf.phi.h;
+      pf.phi.unchecked(i, j) = min1 - 1.0f * pf.phi.h;
     }
 
     if (min1 * min2 > 0) {
       float avg = (min1 + min2) * 0.5f;
       for (auto &f : fluids) {
-        f.phi(i) -= avg;
+        f.phi.unchecked(i, j) -= avg;
       }
     }
-  }
+  });
 }
 
 /** Computes the gradient norm at each point using Godunov's scheme as described
  * in the osher and fedikew book */
-Array2f gradient_norm(Array2f phi, Array2f sigmoid) {
-  Array2f gradnorm(phi);
+void gradient_norm(Array2f const &phi, Array2f const &sigmoid,
+                   Array2f &gradnorm) {
   gradnorm.set(1.0f);
+  float h = phi.h;
 
-  for (auto it = phi.begin(); it != phi.end(); it++) {
-    vec2 ij = it.ij();
-    if (ij.x < 1 || ij.x >= phi.sx - 1 || ij.y < 1 || ij.y >= phi.sy - 1)
-      continue;
-    float a = sigmoid(ij);
-    float h = phi.h;
+  /* the border keeps a norm of 1, so only the interior is visited, where the
+   * neighbors need no clamping */
+  auto interior = [&](int i, int j) {
+    float a = sigmoid.unchecked(i, j);
+    float center = phi.unchecked(i, j);
 
     float dx = 0;
     float dy = 0;
 
-    float dxn = (phi(ij) - phi(ij - vec2(1, 0))) / h;
-    float dxp = (phi(ij + vec2(1, 0)) - phi(ij)) / h;
+    float dxn = (center - phi.unchecked(i - 1, j)) / h;
+    float dxp = (phi.unchecked(i + 1, j) - center) / h;
     if (a >= 0) {
       dxn = (dxn > 0) ? dxn * dxn : 0;
       dxp = (dxp < 0) ? dxp * dxp : 0;
@@ -82,8 +84,8 @@ Array2f gradient_norm(Array2f phi, Array2f sigmoid) {
       dx = std::max(dxn, dxp);
     }
 
-    float dyn = (phi(ij) - phi(ij - vec2(0, 1))) / h;
-    float dyp = (phi(ij + vec2(0, 1)) - phi(ij)) / h;
+    float dyn = (center - phi.unchecked(i, j - 1)) / h;
+    float dyp = (phi.unchecked(i, j + 1) - center) / h;
     if (a >= 0) {
       dyn = (dyn > 0) ? dyn * dyn : 0;
       dyp = (dyp < 0) ? dyp * dyp : 0;
@@ -94,23 +96,25 @@ Array2f gradient_norm(Array2f phi, Array2f sigmoid) {
       dy = std::max(dyn, dyp);
     }
 
-    gradnorm(ij) = sqrt(dx + dy);
-  }
-  return gradnorm;
+    gradnorm.unchecked(i, j) = sqrt(dx + dy);
+  };
+  phi.for_each_split(interior, [](int i, int j) {});
 }
 
-Array2f compute_sigmoid(Array2f phi) {
-  Array2f sigmoid(phi);
-  sigmoid.clear();
-  for (int i = 0; i < phi.size(); i++) {
-    sigmoid(i) = phi(i) / sqrt(pow(phi(i), 2.0f) + pow(phi.h, 2.0f));
-  }
-  return sigmoid;
+void compute_sigmoid(Array2f const &phi, Array2f &sigmoid) {
+  phi.for_each_ij([&](int i, int j) {
+    float value = phi.unchecked(i, j);
+    sigmoid.unchecked(i, j) =
+        value / sqrt(pow(value, 2.0f) + pow(phi.h, 2.0f));
+  });
 }
 
-void reinitialize_phi(Fluid &f) {
-  Array2f sigmoid = compute_sigmoid(f.phi);
-  Array2f gradnorm = gradient_norm(f.phi, sigmoid);
+/** the temporaries come from scratch, see ScratchPool */
+void reinitialize_phi(Fluid &f, ScratchPool<float> &scratch) {
+  auto sigmoid = scratch.acquire(f.phi);
+  auto gradnorm = scratch.acquire(f.phi);
+  compute_sigmoid(f.phi, *sigmoid);
+  gradient_norm(f.phi, *sigmoid, *gradnorm);
 
   float err = 0;
   float tol = 1e-1;
@@ -120,29 +124,44 @@ void reinitialize_phi(Fluid &f) {
   for (int iter = 0; iter <= max_iters; iter++) {
     // assert(iter != max_iters);
     // apply the update
-    for (int i = 0; i < f.phi.size(); i++) {
-      f.phi(i) -= sigmoid(i) * (gradnorm(i) - 1.0f) * dt;
-    }
+    f.phi.for_each_ij([&](int i, int j) {
+      f.phi.unchecked(i, j) -= sigmoid->unchecked(i, j) *
+                               (gradnorm->unchecked(i, j) - 1.0f) * dt;
+    });
     // check updated error
-    gradnorm = gradient_norm(f.phi, sigmoid);
+    gradient_norm(f.phi, *sigmoid, *gradnorm);
     err = 0;
-    for (int i = 0; i < f.phi.size(); i++) {
-      err += abs(gradnorm(i) - 1.0f);
-    }
+    gradnorm->for_each_ij([&](int i, int j) {
+      err += abs(gradnorm->unchecked(i, j) - 1.0f);
+    });
     err /= static_cast<float>(f.phi.size());
     if (err < tol)
       break;
   }
 }
 
-void advect_phi(Array2f &u, Array2f &v, Array2f &phi, float dt) {
-  Array2f new_phi(phi);
-  for (auto it = phi.begin(); it != phi.end(); it++) {
-    vec2 ij = it.ij();
-    vec2 world_position = phi.worldspace_of(ij);
-    vec2 velocity(u.value_at(world_position), v.value_at(world_position));
+void advect_phi(AlignedArray2f const &u, AlignedArray2f const &v,
+                Array2f &phi, float dt, ScratchPool<float> &scratch) {
+  /* every cell is written, by either the interior or the border loop */
+  auto scratch_phi = scratch.acquire(phi);
+  Array2f &new_phi = *scratch_phi;
+  auto velocity_at = [&](int i, int j) {
+    vec2 world_position = phi.worldspace_of(i, j);
+    return vec2(u.value_at(world_position), v.value_at(world_position));
+  };
+  /* only the border needs upwind_gradient's range checks */
+  auto interior = [&](int i, int j) {
+    vec2 velocity = velocity_at(i, j);
+    vec2 del_phi = upwind_gradient_interior(phi, velocity, i, j);
+    new_phi.unchecked(i, j) =
+        phi.unchecked(i, j) - dt * dot(velocity, del_phi);
+  };
+  auto border = [&](int i, int j) {
+    vec2 ij(i, j);
+    vec2 velocity = velocity_at(i, j);
     vec2 del_phi = upwind_gradient(phi, velocity, ij);
     new_phi(ij) = phi(ij) - dt * dot(velocity, del_phi);
-  }
-  phi = new_phi;
+  };
+  phi.for_each_split(interior, border);
+  std::swap(phi.data, new_phi.data);
 }
@@ -0,0 +1,136 @@
+#include "matrix_free.hpp"
+#include <algorithm>
+#include <cmath>
+
+void MatrixFreePoisson::apply(Array2d const &in, Array2d &out) {
+  Array2d const &u_faces = *bu;
+  Array2d const &v_faces = *bv;
+  int sx = in.sx;
+  int sy = in.sy;
+  for (int j = 0; j < sy; j++) {
+    /* the faces on the border of the grid are 0, so the rows and cells they
+     * would reach are clamped instead of checked */
+    double const *center = in.row(j);
+    double const *below = in.row(std::max(j - 1, 0));
+    double const *above = in.row(std::min(j + 1, sy - 1));
+    double const *left = u_faces.row(j); // left[i + 1] is the right face
+    double const *bottom = v_faces.row(j);
+    double const *top = v_faces.row(j + 1);
+    double *result = out.row(j);
+    auto cell = [&](int i, int west, int east) {
+      double c = center[i];
+      return left[i + 1] * (center[east] - c) + left[i] * (center[west] - c) +
+             top[i] * (above[i] - c) + bottom[i] * (below[i] - c);
+    };
+    result[0] = cell(0, 0, std::min(1, sx - 1));
+    for (int i = 1; i < sx - 1; i++)
+      result[i] = cell(i, i - 1, i + 1);
+    if (sx > 1)
+      result[sx - 1] = cell(sx - 1, sx - 2, sx - 1);
+  }
+}
+
+/** Subtracts the mean over the non-solid cells. Like the assembled matrix,
+ * this operator is exactly singular in a closed box, so a right hand side that
+ * is only consistent up to roundoff would make CG diverge once the residual
+ * reaches that level. */
+void MatrixFreePoisson::remove_mean(Array2d &a) {
+  double sum = 0;
+  int count = 0;
+  for (int i = 0; i < a.size(); i++) {
+    if ((*solid_phi)(i) <= 0)
+      continue;
+    sum += a(i);
+    count++;
+  }
+  if (count == 0)
+    return;
+  double mean = sum / count;
+  for (int i = 0; i < a.size(); i++) {
+    if ((*solid_phi)(i) > 0)
+      a(i) -= mean;
+  }
+}
+
+/** dot product over the non-solid cells */
+double MatrixFreePoisson::dot(Array2d &a, Array2d &b) {
+  double sum = 0;
+  for (int i = 0; i < a.size(); i++) {
+    if ((*solid_phi)(i) > 0)
+      sum += a(i) * b(i);
+  }
+  return sum;
+}
+
+void MatrixFreePoisson::solve(Array2d &b, Array2d &x, double tolerance,
+                              int max_iterations) {
+  Array2f &solid = *solid_phi;
+  Array2d const &u_faces = *bu;
+  Array2d const &v_faces = *bv;
+  if (r.size() != b.size())
+    inverse_diagonal = r = z = p = q = b;
+
+  /* the inverted diagonal of the jacobi preconditioner, the sum of the faces
+   * of every cell */
+  for (int j = 0; j < solid.sy; j++) {
+    double const *left = u_faces.row(j);
+    double const *bottom = v_faces.row(j);
+    double const *top = v_faces.row(j + 1);
+    double *inverse = inverse_diagonal.row(j);
+    for (int i = 0; i < solid.sx; i++) {
+      double diagonal = -(left[i] + left[i + 1] + bottom[i] + top[i]);
+      inverse[i] = (diagonal != 0) ? 1.0 / diagonal : 1.0;
+    }
+  }
+
+  iterations = 0;
+  double b_norm = std::sqrt(dot(b, b));
+  if (b_norm == 0) {
+    x.clear();
+    error = 0;
+    return;
+  }
+
+  /* r = b - Ax */
+  apply(x, q);
+  for (int i = 0; i < r.size(); i++)
+    r(i) = (solid(i) > 0) ? b(i) - q(i) : 0;
+  if (project_null_space)
+    remove_mean(r);
+  error = std::sqrt(dot(r, r)) / b_norm;
+  if (error < tolerance)
+    return;
+
+  for (int i = 0; i < z.size(); i++)
+    z(i) = inverse_diagonal(i) * r(i);
+  if (project_null_space)
+    remove_mean(z);
+  p.data = z.data;
+  double rho = dot(r, z);
+  while (iterations < max_iterations) {
+    apply(p, q);
+    double alpha = rho / dot(p, q);
+    for (int i = 0; i < x.size(); i++) {
+      if (solid(i) <= 0)
+        continue;
+      x(i) += alpha * p(i);
+      r(i) -= alpha * q(i);
+    }
+    if (project_null_space)
+      remove_mean(r);
+    iterations++;
+    error = std::sqrt(dot(r, r)) / b_norm;
+    if (error < tolerance)
+      break;
+
+    for (int i = 0; i < z.size(); i++)
+      z(i) = inverse_diagonal(i) * r(i);
+    if (project_null_space)
+      remove_mean(z);
+    double rho_new = dot(r, z);
+    double beta = rho_new / rho;
+    rho = rho_new;
+    for (int i = 0; i < p.size(); i++)
+      p(i) = z(i) + beta * p(i);
+  }
+}
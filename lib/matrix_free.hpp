@@ -0,0 +1,45 @@
+#pragma once
+#include "array2.hpp"
+
+/** \class MatrixFreePoisson
+ * The variable coefficient poisson operator of the pressure solve, applied
+ * without storing a matrix:
+ *   (Ax)_c = sum over faces f of c: b_f * (x_neighbor - x_c)
+ * It reads the face coefficients that the simulation computes every substep
+ * for apply_pressure_gradient, so a product streams one value per face and
+ * the vector it is applied to, and every face enters both of its rows with the
+ * same value. Faces with a solid cell on either side must be 0. Vectors live
+ * on the cell grid and are 0 in solid cells.
+ *
+ * The driver is a Jacobi preconditioned conjugate gradient, so that it can be
+ * compared directly against Eigen's default ConjugateGradient.
+ */
+class MatrixFreePoisson {
+public:
+  Array2f *solid_phi = nullptr;
+  Array2d *bu = nullptr; // coefficients of the u-faces, bu(i, j) couples
+                         // cells (i-1, j) and (i, j)
+  Array2d *bv = nullptr; // coefficients of the v-faces, bv(i, j) couples
+                         // cells (i, j-1) and (i, j)
+
+  bool project_null_space = true; // remove the constant mode (closed domains)
+
+  int iterations = 0; // iterations used by the last solve
+  double error = 0;   // relative residual reached by the last solve
+
+  MatrixFreePoisson() {}
+  MatrixFreePoisson(Array2f *solid_phi_, Array2d *bu_, Array2d *bv_)
+      : solid_phi(solid_phi_), bu(bu_), bv(bv_) {}
+
+  /** out = A * in */
+  void apply(Array2d const &in, Array2d &out);
+
+  /** Solves Ax = b until |b - Ax| / |b| < tolerance. x holds the initial
+   * guess on entry. */
+  void solve(Array2d &b, Array2d &x, double tolerance, int max_iterations);
+
+private:
+  Array2d inverse_diagonal, r, z, p, q; // reused between solves
+  double dot(Array2d &a, Array2d &b);
+  void remove_mean(Array2d &a);
+};
@@ -0,0 +1,160 @@
+#pragma once
+#include <cmath>
+#include <eigen3/Eigen/SparseCore>
+#include <vector>
+
+/** \class ModifiedIncompleteCholesky
+ * A MIC(0) preconditioner in the form expected by Eigen's iterative solvers,
+ * following the construction in Bridson's "Fluid Simulation for Computer
+ * Graphics". It is written for the 5-point variable coefficient stencil of
+ * Simulation's poisson matrix (see assemble_poisson_pattern): cells are
+ * numbered row by row, so every row couples to at most two lower neighbors
+ * (left and below) and two upper neighbors (right and above), and the factor
+ * keeps exactly that pattern (no fill-in).
+ *
+ * The assembled matrix is negative semidefinite, so the factorization is
+ * carried out on -A and the sign is restored when applying the preconditioner.
+ */
+class ModifiedIncompleteCholesky {
+  typedef Eigen::VectorXd Vector;
+
+public:
+  typedef Vector::StorageIndex StorageIndex;
+  enum {
+    ColsAtCompileTime = Eigen::Dynamic,
+    MaxColsAtCompileTime = Eigen::Dynamic
+  };
+
+  double tau = 0.97;   // amount of modification, 0 gives plain IC(0)
+  double sigma = 0.25; // small pivots fall back to the diagonal
+
+  ModifiedIncompleteCholesky() {}
+
+  template <typename MatType>
+  explicit ModifiedIncompleteCholesky(MatType const &mat) {
+    compute(mat);
+  }
+
+  Eigen::Index rows() const { return precon.size(); }
+  Eigen::Index cols() const { return precon.size(); }
+
+  /** records, for every row, where its lower and upper neighbors live */
+  template <typename MatType>
+  ModifiedIncompleteCholesky &analyzePattern(MatType const &mat) {
+    int n = mat.cols();
+    lower_start.assign(n + 1, 0);
+    upper_start.assign(n + 1, 0);
+    lower_index.clear();
+    upper_index.clear();
+    for (int col = 0; col < n; col++) {
+      for (typename MatType::InnerIterator it(mat, col); it; ++it) {
+        int row = it.index();
+        if (row < col)
+          lower_index.push_back(row);
+        else if (row > col)
+          upper_index.push_back(row);
+      }
+      lower_start[col + 1] = lower_index.size();
+      upper_start[col + 1] = upper_index.size();
+    }
+    lower_value.resize(lower_index.size());
+    upper_value.resize(upper_index.size());
+    precon.resize(n);
+    pattern_initialized = true;
+    return *this;
+  }
+
+  /** computes the MIC(0) pivots, reusing the pattern from analyzePattern */
+  template <typename MatType>
+  ModifiedIncompleteCholesky &factorize(MatType const &mat) {
+    if (!pattern_initialized)
+      analyzePattern(mat);
+    int n = mat.cols();
+    diagonal.setZero(n);
+    q.resize(n);
+    z.resize(n);
+    sign = 1.0;
+    for (int col = 0; col < n; col++) {
+      int l = lower_start[col];
+      int u = upper_start[col];
+      for (typename MatType::InnerIterator it(mat, col); it; ++it) {
+        if (it.index() < col)
+          lower_value[l++] = it.value();
+        else if (it.index() > col)
+          upper_value[u++] = it.value();
+        else
+          diagonal(col) = it.value();
+      }
+    }
+    if (n > 0 && diagonal.sum() < 0) {
+      sign = -1.0;
+      diagonal = -diagonal;
+      for (auto &value : lower_value)
+        value = -value;
+      for (auto &value : upper_value)
+        value = -value;
+    }
+
+    for (int row = 0; row < n; row++) {
+      double e = diagonal(row);
+      for (int l = lower_start[row]; l < lower_start[row + 1]; l++) {
+        int k = lower_index[l];
+        double a_kr = lower_value[l];
+        double t = a_kr * precon(k);
+        /* the entries of k's row that are discarded by keeping the pattern */
+        double dropped = 0;
+        for (int u = upper_start[k]; u < upper_start[k + 1]; u++) {
+          if (upper_index[u] != row)
+            dropped += upper_value[u];
+        }
+        e -= t * t + tau * a_kr * dropped * precon(k) * precon(k);
+      }
+      if (e < sigma * diagonal(row))
+        e = diagonal(row);
+      precon(row) = (e > 0) ? 1.0 / std::sqrt(e) : 0.0;
+    }
+    is_initialized = true;
+    return *this;
+  }
+
+  template <typename MatType>
+  ModifiedIncompleteCholesky &compute(MatType const &mat) {
+    analyzePattern(mat);
+    return factorize(mat);
+  }
+
+  /** applies (L L^T)^-1 with a forward and a backward substitution. The
+   * result lives in a buffer that factorize sized and the next call reuses,
+   * so applying the preconditioner does not allocate. */
+  template <typename Rhs> Vector const &solve(Rhs const &b) const {
+    int n = precon.size();
+    for (int row = 0; row < n; row++) {
+      double t = b(row);
+      for (int l = lower_start[row]; l < lower_start[row + 1]; l++)
+        t -= lower_value[l] * precon(lower_index[l]) * q(lower_index[l]);
+      q(row) = t * precon(row);
+    }
+    for (int row = n - 1; row >= 0; row--) {
+      double t = q(row);
+      for (int u = upper_start[row]; u < upper_start[row + 1]; u++)
+        t -= upper_value[u] * precon(row) * z(upper_index[u]);
+      z(row) = t * precon(row);
+    }
+    z *= sign;
+    return z;
+  }
+
+  Eigen::ComputationInfo info() {
+    return is_initialized ? Eigen::Success : Eigen::NumericalIssue;
+  }
+
+private:
+  Vector precon;       // reciprocal square root of the modified pivots
+  Vector diagonal;     // the diagonal of the last factorized matrix
+  mutable Vector q, z; // the forward and backward substitutions of solve
+  double sign = 1.0;
+  std::vector<int> lower_start, lower_index, upper_start, upper_index;
+  std::vector<double> lower_value, upper_value;
+  bool pattern_initialized = false;
+  bool is_initialized = false;
+};
@@ -0,0 +1,385 @@
+#include "multigrid.hpp"
+#include <cmath>
+
+namespace {
+
+/** Cell-centered bilinear interpolation weights from the coarse grid to the
+ * fine cell (i, j). The fine cell lies within coarse cell (i/2, j/2) and is
+ * closest to the coarse neighbor on its own side. Weights of coarse cells that
+ * are outside the grid or inactive are dropped and the rest renormalized, so
+ * that nothing is interpolated across solid boundaries. Returns the number of
+ * coarse cells written to I, J and w. */
+int interpolation_stencil(MultigridLevel &coarse, int i, int j, int I[4],
+                          int J[4], double w[4]) {
+  int ci = i / 2;
+  int cj = j / 2;
+  int ni = (i % 2 == 0) ? ci - 1 : ci + 1;
+  int nj = (j % 2 == 0) ? cj - 1 : cj + 1;
+  int candidates_i[4] = {ci, ni, ci, ni};
+  int candidates_j[4] = {cj, cj, nj, nj};
+  double weights[4] = {9.0 / 16.0, 3.0 / 16.0, 3.0 / 16.0, 1.0 / 16.0};
+
+  int count = 0;
+  double total = 0;
+  for (int n = 0; n < 4; n++) {
+    int a = candidates_i[n];
+    int b = candidates_j[n];
+    if (a < 0 || b < 0 || a >= coarse.sx || b >= coarse.sy ||
+        !coarse.active(a, b))
+      continue;
+    I[count] = a;
+    J[count] = b;
+    w[count] = weights[n];
+    total += weights[n];
+    count++;
+  }
+  for (int n = 0; n < count; n++)
+    w[n] /= total;
+  return count;
+}
+
+} // namespace
+
+void MultigridSolver::build(Array2f const &solid_phi,
+                            Array2d const &u_coefficients,
+                            Array2d const &v_coefficients) {
+  build_hierarchy(solid_phi);
+  update_coefficients(u_coefficients, v_coefficients);
+}
+
+void MultigridSolver::build_hierarchy(Array2f const &solid_phi,
+                                      Array2i const *dirichlet) {
+  int sx = solid_phi.sx;
+  int sy = solid_phi.sy;
+  if (levels.empty() || levels[0].sx != sx || levels[0].sy != sy) {
+    levels.clear();
+    float h = solid_phi.h;
+    levels.emplace_back(sx, sy, h);
+    r = z = p = q = levels[0].x;
+    while (std::min(levels.back().sx, levels.back().sy) > 4) {
+      h *= 2.f;
+      levels.emplace_back((levels.back().sx + 1) / 2,
+                          (levels.back().sy + 1) / 2, h);
+    }
+  }
+
+  MultigridLevel &finest = levels[0];
+  this->dirichlet = finest.active;
+  this->dirichlet.clear();
+  for (int j = 0; j < sy; j++) {
+    for (int i = 0; i < sx; i++) {
+      bool held = (dirichlet != nullptr && (*dirichlet)(i, j));
+      finest.active(i, j) = (solid_phi(i, j) > 0 && !held) ? 1 : 0;
+      this->dirichlet(i, j) = (solid_phi(i, j) > 0 && held) ? 1 : 0;
+    }
+  }
+  for (int l = 1; l < (int)levels.size(); l++) {
+    coarsen_active_cells(levels[l - 1], levels[l]);
+  }
+}
+
+void MultigridSolver::update_coefficients(Array2d const &u_coefficients,
+                                          Array2d const &v_coefficients) {
+  /* the finest level comes straight from the simulation, with the faces
+   * between two active cells, or an active and a dirichlet cell */
+  MultigridLevel &finest = levels[0];
+  auto open = [&](int i, int j) {
+    return finest.active(i, j) || dirichlet(i, j);
+  };
+  finest.bu.clear();
+  for (int j = 0; j < finest.sy; j++) {
+    for (int i = 1; i < finest.sx; i++) {
+      if ((finest.active(i - 1, j) || finest.active(i, j)) &&
+          open(i - 1, j) && open(i, j))
+        finest.bu(i, j) = u_coefficients(i, j);
+    }
+  }
+  finest.bv.clear();
+  for (int j = 1; j < finest.sy; j++) {
+    for (int i = 0; i < finest.sx; i++) {
+      if ((finest.active(i, j - 1) || finest.active(i, j)) &&
+          open(i, j - 1) && open(i, j))
+        finest.bv(i, j) = v_coefficients(i, j);
+    }
+  }
+
+  for (int l = 1; l < (int)levels.size(); l++) {
+    coarsen_coefficients(levels[l - 1], levels[l]);
+  }
+}
+
+/** A coarse cell is active if any of its children are */
+void MultigridSolver::coarsen_active_cells(MultigridLevel &fine,
+                                           MultigridLevel &coarse) {
+  for (int J = 0; J < coarse.sy; J++) {
+    for (int I = 0; I < coarse.sx; I++) {
+      int any_active = 0;
+      for (int j = 2 * J; j < std::min(2 * J + 2, fine.sy); j++) {
+        for (int i = 2 * I; i < std::min(2 * I + 2, fine.sx); i++) {
+          any_active |= fine.active(i, j);
+        }
+      }
+      coarse.active(I, J) = any_active;
+    }
+  }
+}
+
+/** A coarse face covers two fine faces; their average is the coarse
+ * coefficient, which is then divided by 4 to account for the doubled cell
+ * size. */
+void MultigridSolver::coarsen_coefficients(MultigridLevel &fine,
+                                           MultigridLevel &coarse) {
+  coarse.bu.clear();
+  for (int J = 0; J < coarse.sy; J++) {
+    for (int I = 1; I < coarse.sx; I++) {
+      double sum = fine.bu(2 * I, 2 * J);
+      if (2 * J + 1 < fine.sy)
+        sum += fine.bu(2 * I, 2 * J + 1);
+      coarse.bu(I, J) = sum / 8.0;
+    }
+  }
+  coarse.bv.clear();
+  for (int J = 1; J < coarse.sy; J++) {
+    for (int I = 0; I < coarse.sx; I++) {
+      double sum = fine.bv(2 * I, 2 * J);
+      if (2 * I + 1 < fine.sx)
+        sum += fine.bv(2 * I + 1, 2 * J);
+      coarse.bv(I, J) = sum / 8.0;
+    }
+  }
+}
+
+/** Red-black Gauss-Seidel. A reversed sweep visits black cells before red
+ * ones, so a forward smooth followed by a reversed smooth is symmetric. */
+void MultigridSolver::smooth(MultigridLevel &level, int sweeps, bool reverse) {
+  for (int sweep = 0; sweep < sweeps; sweep++) {
+    for (int pass = 0; pass < 2; pass++) {
+      int color = reverse ? 1 - pass : pass;
+      for (int j = 0; j < level.sy; j++) {
+        for (int i = (j + color) % 2; i < level.sx; i += 2) {
+          if (!level.active(i, j))
+            continue;
+          double diagonal = level.bu(i, j) + level.bu(i + 1, j) +
+                            level.bv(i, j) + level.bv(i, j + 1);
+          if (diagonal == 0)
+            continue;
+          double sum = level.bu(i, j) * level.x(i - 1, j) +
+                       level.bu(i + 1, j) * level.x(i + 1, j) +
+                       level.bv(i, j) * level.x(i, j - 1) +
+                       level.bv(i, j + 1) * level.x(i, j + 1);
+          level.x(i, j) = (sum - level.b(i, j)) / diagonal;
+        }
+      }
+    }
+  }
+}
+
+/** Stores b - Ax in the level's residual and returns its 2-norm */
+double MultigridSolver::compute_residual(MultigridLevel &level) {
+  double norm = 0;
+  for (int j = 0; j < level.sy; j++) {
+    for (int i = 0; i < level.sx; i++) {
+      if (!level.active(i, j)) {
+        level.r(i, j) = 0;
+        continue;
+      }
+      double center = level.x(i, j);
+      double Ax = level.bu(i, j) * (level.x(i - 1, j) - center) +
+                  level.bu(i + 1, j) * (level.x(i + 1, j) - center) +
+                  level.bv(i, j) * (level.x(i, j - 1) - center) +
+                  level.bv(i, j + 1) * (level.x(i, j + 1) - center);
+      level.r(i, j) = level.b(i, j) - Ax;
+      norm += level.r(i, j) * level.r(i, j);
+    }
+  }
+  return std::sqrt(norm);
+}
+
+/** out = A * in, the same stencil as compute_residual */
+void MultigridSolver::apply_operator(MultigridLevel &level, Array2d &in,
+                                     Array2d &out) {
+  for (int j = 0; j < level.sy; j++) {
+    for (int i = 0; i < level.sx; i++) {
+      if (!level.active(i, j)) {
+        out(i, j) = 0;
+        continue;
+      }
+      double center = in(i, j);
+      out(i, j) = level.bu(i, j) * (in(i - 1, j) - center) +
+                  level.bu(i + 1, j) * (in(i + 1, j) - center) +
+                  level.bv(i, j) * (in(i, j - 1) - center) +
+                  level.bv(i, j + 1) * (in(i, j + 1) - center);
+    }
+  }
+}
+
+/** Subtracts the mean over the active cells. The domain is a closed box, so
+ * the system is singular with the constant as its null space: the right hand
+ * side is only consistent up to roundoff, and a V-cycle applied to a residual
+ * with a nonzero mean would drift in the constant mode. */
+void MultigridSolver::remove_mean(MultigridLevel &level, Array2d &a) {
+  double sum = 0;
+  int count = 0;
+  for (int i = 0; i < a.size(); i++) {
+    if (!level.active(i))
+      continue;
+    sum += a(i);
+    count++;
+  }
+  if (count == 0)
+    return;
+  double mean = sum / count;
+  for (int i = 0; i < a.size(); i++) {
+    if (level.active(i))
+      a(i) -= mean;
+  }
+}
+
+/** dot product restricted to the active cells of a level */
+double MultigridSolver::dot(MultigridLevel &level, Array2d &a, Array2d &b) {
+  double sum = 0;
+  for (int i = 0; i < a.size(); i++) {
+    if (level.active(i))
+      sum += a(i) * b(i);
+  }
+  return sum;
+}
+
+/** The transpose of prolongation, scaled by 1/4 so that a smooth residual keeps
+ * its magnitude on the coarse grid */
+void MultigridSolver::restrict_residual(MultigridLevel &fine,
+                                        MultigridLevel &coarse) {
+  coarse.b.clear();
+  int I[4], J[4];
+  double w[4];
+  for (int j = 0; j < fine.sy; j++) {
+    for (int i = 0; i < fine.sx; i++) {
+      if (!fine.active(i, j))
+        continue;
+      int count = interpolation_stencil(coarse, i, j, I, J, w);
+      for (int n = 0; n < count; n++)
+        coarse.b(I[n], J[n]) += 0.25 * w[n] * fine.r(i, j);
+    }
+  }
+}
+
+void MultigridSolver::prolongate_correction(MultigridLevel &coarse,
+                                            MultigridLevel &fine) {
+  int I[4], J[4];
+  double w[4];
+  for (int j = 0; j < fine.sy; j++) {
+    for (int i = 0; i < fine.sx; i++) {
+      if (!fine.active(i, j))
+        continue;
+      int count = interpolation_stencil(coarse, i, j, I, J, w);
+      for (int n = 0; n < count; n++)
+        fine.x(i, j) += w[n] * coarse.x(I[n], J[n]);
+    }
+  }
+}
+
+void MultigridSolver::cycle(int l) {
+  MultigridLevel &level = levels[l];
+  if (l == (int)levels.size() - 1) {
+    smooth(level, coarsest_sweeps, false);
+    smooth(level, coarsest_sweeps, true);
+    return;
+  }
+  MultigridLevel &coarse = levels[l + 1];
+  smooth(level, pre_sweeps, false);
+  compute_residual(level);
+  restrict_residual(level, coarse);
+  coarse.x.clear();
+  cycle(l + 1);
+  prolongate_correction(coarse, level);
+  smooth(level, post_sweeps, true);
+}
+
+void MultigridSolver::solve(Array2d &rhs, Array2d &x, double tolerance,
+                            int max_cycles) {
+  MultigridLevel &finest = levels[0];
+  finest.b.data = rhs.data;
+  finest.x.data = x.data;
+  if (project_null_space)
+    remove_mean(finest, finest.b);
+
+  double b_norm = 0;
+  for (int i = 0; i < finest.b.size(); i++) {
+    if (finest.active(i))
+      b_norm += finest.b(i) * finest.b(i);
+  }
+  b_norm = std::sqrt(b_norm);
+  iterations = 0;
+  if (b_norm == 0) {
+    x.clear();
+    error = 0;
+    return;
+  }
+  error = compute_residual(finest) / b_norm;
+  while (error >= tolerance && iterations < max_cycles) {
+    cycle(0);
+    iterations++;
+    error = compute_residual(finest) / b_norm;
+  }
+  x.data = finest.x.data;
+}
+
+void MultigridSolver::solve_preconditioned_cg(Array2d &rhs, Array2d &x,
+                                              double tolerance,
+                                              int max_iterations) {
+  MultigridLevel &finest = levels[0];
+  iterations = 0;
+  double b_norm = std::sqrt(dot(finest, rhs, rhs));
+  if (b_norm == 0) {
+    x.clear();
+    error = 0;
+    return;
+  }
+
+  /* r = b - Ax */
+  apply_operator(finest, x, q);
+  for (int i = 0; i < r.size(); i++)
+    r(i) = rhs(i) - q(i);
+  if (project_null_space)
+    remove_mean(finest, r);
+  error = std::sqrt(dot(finest, r, r)) / b_norm;
+  if (error < tolerance)
+    return;
+
+  vcycle(r, z);
+  if (project_null_space)
+    remove_mean(finest, z);
+  p.data = z.data;
+  double rho = dot(finest, r, z);
+  while (iterations < max_iterations) {
+    apply_operator(finest, p, q);
+    double alpha = rho / dot(finest, p, q);
+    for (int i = 0; i < x.size(); i++) {
+      if (!finest.active(i))
+        continue;
+      x(i) += alpha * p(i);
+      r(i) -= alpha * q(i);
+    }
+    iterations++;
+    error = std::sqrt(dot(finest, r, r)) / b_norm;
+    if (error < tolerance)
+      break;
+
+    vcycle(r, z);
+    if (project_null_space)
+      remove_mean(finest, z);
+    double rho_new = dot(finest, r, z);
+    double beta = rho_new / rho;
+    rho = rho_new;
+    for (int i = 0; i < p.size(); i++)
+      p(i) = z(i) + beta * p(i);
+  }
+}
+
+void MultigridSolver::vcycle(Array2d &rhs, Array2d &x) {
+  MultigridLevel &finest = levels[0];
+  finest.b.data = rhs.data;
+  finest.x.clear();
+  cycle(0);
+  x.data = finest.x.data;
+}
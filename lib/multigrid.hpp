@@ -0,0 +1,98 @@
+#pragma once
+#include "array2.hpp"
+#include <vector>
+
+/** \class MultigridLevel
+ * One level of the multigrid hierarchy. The operator is stored as the
+ * coefficients of the faces between cells, so that
+ *   (Ax)_c = sum over faces f of c: b_f * (x_neighbor - x_c)
+ * which is the same 5-point stencil as the assembled poisson matrix. Faces
+ * touching an inactive (solid) cell have a coefficient of 0.
+ */
+struct MultigridLevel {
+  int sx = 0;
+  int sy = 0;
+  Array2i active; // 1 if the cell is an unknown of the system, else 0
+  Array2d bu;     // coefficients of the vertical faces, (sx + 1) x sy
+  Array2d bv;     // coefficients of the horizontal faces, sx x (sy + 1)
+  Array2d x;      // the current solution (or correction)
+  Array2d b;      // the right hand side
+  Array2d r;      // the residual b - Ax
+
+  MultigridLevel(int sx_, int sy_, float h) : sx(sx_), sy(sy_) {
+    active.init(sx, sy, -0.5, -0.5, h);
+    bu.init(sx + 1, sy, 0.0, -0.5, h);
+    bv.init(sx, sy + 1, -0.5, 0.0, h);
+    x.init(sx, sy, -0.5, -0.5, h);
+    b.init(sx, sy, -0.5, -0.5, h);
+    r.init(sx, sy, -0.5, -0.5, h);
+  }
+};
+
+/** \class MultigridSolver
+ * A geometric multigrid solver for the variable coefficient poisson equation
+ * on the collocated cell grid. The finest level is built from the face
+ * coefficients of the simulation, and every coarser level is made by merging
+ * 2x2 blocks of cells and averaging the fine faces that lie on each coarse
+ * face. Transfers between levels use bilinear interpolation (restriction is
+ * its scaled transpose) and the smoother is red-black Gauss-Seidel, which keeps
+ * a V-cycle symmetric so it can also be used as a preconditioner.
+ */
+class MultigridSolver {
+public:
+  int pre_sweeps = 2;       // smoothing sweeps before coarsening
+  int post_sweeps = 2;      // smoothing sweeps after the coarse correction
+  int coarsest_sweeps = 50; // sweeps used in place of a coarsest level solve
+  bool project_null_space = true; // remove the constant mode (closed domains)
+
+  int iterations = 0; // V-cycles used by the last solve
+  double error = 0;   // relative residual reached by the last solve
+
+  /** Builds every level from the active cells (solid_phi > 0) and the
+   * coefficients of the u-faces and v-faces of the finest grid */
+  void build(Array2f const &solid_phi, Array2d const &u_coefficients,
+             Array2d const &v_coefficients);
+
+  /** Allocates the levels and marks their active cells. This only depends on
+   * the solids, so it can be done once and reused across solves. Cells marked
+   * in dirichlet, if given, are not active but held at x = 0 instead of being
+   * walls: their faces to active cells keep their coefficients. */
+  void build_hierarchy(Array2f const &solid_phi,
+                       Array2i const *dirichlet = nullptr);
+
+  /** Refreshes the face coefficients of every level, keeping the hierarchy */
+  void update_coefficients(Array2d const &u_coefficients,
+                           Array2d const &v_coefficients);
+
+  /** Runs V-cycles until |b - Ax| / |b| < tolerance. x holds the initial guess
+   * on entry and the solution on exit. */
+  void solve(Array2d &rhs, Array2d &x, double tolerance, int max_cycles);
+
+  /** Conjugate gradient preconditioned with one V-cycle per iteration, which
+   * stays robust where plain V-cycles stall on large jumps in the
+   * coefficients. Stops at the same criterion as solve, with max_iterations
+   * bounding the number of CG iterations (and therefore V-cycles). */
+  void solve_preconditioned_cg(Array2d &rhs, Array2d &x, double tolerance,
+                               int max_iterations);
+
+  /** Applies one V-cycle with a zero initial guess, approximating x = A^-1 b */
+  void vcycle(Array2d &rhs, Array2d &x);
+
+  int number_of_levels() { return levels.size(); }
+
+private:
+  std::vector<MultigridLevel> levels;
+  Array2i dirichlet; // 1 for the cells of the finest level held at x = 0
+  Array2d r, z, p, q; // conjugate gradient vectors on the finest grid
+
+  void cycle(int l);
+  void smooth(MultigridLevel &level, int sweeps, bool reverse);
+  double compute_residual(MultigridLevel &level);
+  void apply_operator(MultigridLevel &level, Array2d &in, Array2d &out);
+  double dot(MultigridLevel &level, Array2d &a, Array2d &b);
+  void remove_mean(MultigridLevel &level, Array2d &a);
+  void restrict_residual(MultigridLevel &fine, MultigridLevel &coarse);
+  void prolongate_correction(MultigridLevel &coarse, MultigridLevel &fine);
+  void coarsen_active_cells(MultigridLevel &fine, MultigridLevel &coarse);
+  void coarsen_coefficients(MultigridLevel &fine, MultigridLevel &coarse);
+};
@@ -0,0 +1,26 @@
+#pragma once
+#include <eigen3/Eigen/Core>
+
+/** \class NullSpaceProjection
+ * Wraps one of Eigen's preconditioners so that, when project is set, the
+ * constant vector is removed from everything it returns. In a closed box the
+ * poisson matrix has the constant pressure as its null space, and with every
+ * search direction of CG orthogonal to it the iterates cannot drift along it.
+ * With project unset it behaves exactly like Preconditioner.
+ */
+template <typename Preconditioner>
+class NullSpaceProjection : public Preconditioner {
+public:
+  bool project = false;
+
+  /** the preconditioned b, in a buffer that the next call reuses */
+  template <typename Rhs> Eigen::VectorXd const &solve(Rhs const &b) const {
+    z = Preconditioner::solve(b);
+    if (project)
+      z.array() -= z.mean();
+    return z;
+  }
+
+private:
+  mutable Eigen::VectorXd z; // kept so that applying it does not allocate
+};
@@ -0,0 +1,207 @@
+#pragma once
+#include "array2.hpp"
+#include <cmath>
+
+/** How PaddedArray2::fill_ghosts fills the cells outside of the grid */
+enum class GhostPolicy {
+  CLAMP,   // repeat the nearest edge cell, like Array2's clamped accessors
+  ZERO,    // 0 everywhere outside the grid
+  PERIODIC // wrap around to the opposite edge
+};
+
+/** \class PaddedArray2
+ * An Array2 surrounded by `ghost` layers of extra cells on every side, so that
+ * stencils and bilinear lookups near the edge read valid memory instead of
+ * clamping every index. The ghost cells are filled once by fill_ghosts (or
+ * copy_from) according to the boundary policy, after which (i, j) is valid
+ * for -ghost <= i < sx + ghost and -ghost <= j < sy + ghost without any
+ * branches. Rows are pitch = sx + 2 * ghost elements apart.
+ *
+ * With GhostPolicy::CLAMP, value_at interpolates like Array2::value_at. The
+ * one difference is that the second cell of each axis is always the next one,
+ * where Array2 snaps ij + 1 in float, which skips a cell when ij is within
+ * rounding of the next integer.
+ */
+template <class T> struct PaddedArray2 {
+public:
+  int sx = 0;
+  int sy = 0;
+  int ghost = 0;
+  int pitch = 0;
+  float offset_x = 0;
+  float offset_y = 0;
+  float h = 0;
+  GhostPolicy policy = GhostPolicy::CLAMP;
+  std::vector<T, AlignedAllocator<T>> data;
+
+  PaddedArray2() {}
+
+  /** a padded copy of a, with its ghost cells already filled */
+  template <class Layout>
+  PaddedArray2(Array2<T, Layout> const &a, int ghost_,
+               GhostPolicy policy_ = GhostPolicy::CLAMP) {
+    init(a.sx, a.sy, ghost_, a.offset_x, a.offset_y, a.h, policy_);
+    copy_from(a);
+  }
+
+  /** Makes this a padded copy of a like the constructor does, only
+   * allocating if the shape changed */
+  template <class Layout>
+  void assign(Array2<T, Layout> const &a, int ghost_,
+              GhostPolicy policy_ = GhostPolicy::CLAMP) {
+    if (a.sx != sx || a.sy != sy || ghost_ != ghost)
+      init(a.sx, a.sy, ghost_, a.offset_x, a.offset_y, a.h, policy_);
+    offset_x = a.offset_x;
+    offset_y = a.offset_y;
+    h = a.h;
+    policy = policy_;
+    copy_from(a);
+  }
+
+  void init(int sx_, int sy_, int ghost_, float offset_x_, float offset_y_,
+            float h_, GhostPolicy policy_) {
+    assert(sx_ > 0 && sy_ > 0 && ghost_ >= 1 && h_ != 0);
+    sx = sx_;
+    sy = sy_;
+    ghost = ghost_;
+    pitch = sx + 2 * ghost;
+    offset_x = offset_x_;
+    offset_y = offset_y_;
+    h = h_;
+    policy = policy_;
+    data.assign(pitch * (sy + 2 * ghost), static_cast<T>(0));
+  }
+
+  /** Access to cell (i, j), which may lie in the ghost layers */
+  T &operator()(int i, int j) {
+    assert(i >= -ghost && i < sx + ghost && j >= -ghost && j < sy + ghost);
+    return data[(j + ghost) * pitch + i + ghost];
+  }
+
+  T const &operator()(int i, int j) const {
+    assert(i >= -ghost && i < sx + ghost && j >= -ghost && j < sy + ghost);
+    return data[(j + ghost) * pitch + i + ghost];
+  }
+
+  /** pointer to cell (0, j), rows are pitch elements apart */
+  T *row(int j) { return &(*this)(0, j); }
+
+  /** Copies the cells of a (which must have the same size) and fills the
+   * ghost cells. a may have any layout with rows. */
+  template <class Layout> void copy_from(Array2<T, Layout> const &a) {
+    assert(a.sx == sx && a.sy == sy);
+    for (int j = 0; j < sy; j++)
+      std::copy_n(a.row(j), sx, row(j));
+    fill_ghosts();
+  }
+
+  /** Copies the cells inside the grid back to a */
+  template <class Layout> void copy_to(Array2<T, Layout> &a) {
+    assert(a.sx == sx && a.sy == sy);
+    for (int j = 0; j < sy; j++)
+      std::copy_n(row(j), sx, a.row(j));
+  }
+
+  /** Fills every ghost cell from the cells inside the grid according to the
+   * policy. This has to be called again after the inside changes. */
+  void fill_ghosts() {
+    for (int j = -ghost; j < sy + ghost; j++) {
+      bool inside_row = (j >= 0 && j < sy);
+      for (int i = -ghost; i < sx + ghost; i++) {
+        if (inside_row && i >= 0 && i < sx) {
+          i = sx - 1; // skip to the right ghost layers
+          continue;
+        }
+        if (policy == GhostPolicy::ZERO)
+          (*this)(i, j) = static_cast<T>(0);
+        else
+          (*this)(i, j) = (*this)(source(i, sx), source(j, sy));
+      }
+    }
+  }
+
+  /** interpolates at grid coordinates ij, without clamping the four reads.
+   * With CLAMP the coordinates are clamped to the grid like
+   * Array2::coordinates_at does, otherwise they are kept within the ghost
+   * layers. */
+  T bilerp(vec2 ij) const {
+    assert(!std::isnan(ij.x) && !std::isnan(ij.y));
+    vec2 lower = lower_coordinates();
+    vec2 upper = upper_coordinates();
+    return interpolate(std::clamp(ij.x, lower.x, upper.x),
+                       std::clamp(ij.y, lower.y, upper.y));
+  }
+
+  /** interpolates at a position in world coordinates, see
+   * Array2::coordinates_at */
+  T value_at(vec2 world_position) const {
+    return bilerp(vec2((world_position.x / h) + offset_x,
+                       (world_position.y / h) + offset_y));
+  }
+
+  /** value_at for n points at once, the k-th at world position (x[k], y[k]),
+   * see Array2::values_at. The coordinates are shifted by the ghost layers
+   * before truncating, so that the cell is found without floor and the
+   * corners are read straight from data. */
+  void values_at(float const *x, float const *y, T *values, int n) const {
+    float const inv_h = 1.f / h;
+    vec2 const lower = lower_coordinates() + vec2(ghost);
+    vec2 const upper = upper_coordinates() + vec2(ghost);
+    float const grid_x = offset_x + ghost, grid_y = offset_y + ghost;
+    int const stride = pitch;
+    T const *cells = data.data();
+#pragma omp simd
+    for (int k = 0; k < n; k++) {
+      float gx = std::min(std::max(x[k] * inv_h + grid_x, lower.x), upper.x);
+      float gy = std::min(std::max(y[k] * inv_h + grid_y, lower.y), upper.y);
+      int i = static_cast<int>(gx);
+      int j = static_cast<int>(gy);
+      float fx = gx - static_cast<float>(i);
+      float fy = gy - static_cast<float>(j);
+      int corner = j * stride + i;
+      T bottom = (1.f - fx) * cells[corner] + fx * cells[corner + 1];
+      T top = (1.f - fx) * cells[corner + stride] +
+              fx * cells[corner + stride + 1];
+      values[k] = (1.f - fy) * bottom + fy * top;
+    }
+  }
+
+private:
+  static T lerp(T val1, T val2, float f) {
+    return (1.0f - f) * val1 + f * val2;
+  }
+
+  /** the range bilerp clamps grid coordinates to */
+  vec2 lower_coordinates() const {
+    if (policy == GhostPolicy::CLAMP)
+      return vec2(0.f);
+    return vec2(static_cast<float>(-ghost));
+  }
+  vec2 upper_coordinates() const {
+    if (policy == GhostPolicy::CLAMP)
+      return vec2(sx - 1.f, sy - 1.f);
+    return vec2(sx + ghost - 2.f, sy + ghost - 2.f);
+  }
+
+  /** interpolates at grid coordinates already within those bounds */
+  T interpolate(float x, float y) const {
+    float cell_x = std::floor(x);
+    float cell_y = std::floor(y);
+    float fx = x - cell_x;
+    float fy = y - cell_y;
+    T const *bottom = &(*this)(static_cast<int>(cell_x),
+                               static_cast<int>(cell_y));
+    T const *top = bottom + pitch;
+    return lerp(lerp(bottom[0], bottom[1], fx), lerp(top[0], top[1], fx), fy);
+  }
+
+  /** the cell inside the grid a ghost index k of an axis of n cells copies */
+  int source(int k, int n) const {
+    if (policy == GhostPolicy::PERIODIC)
+      return ((k % n) + n) % n;
+    return std::clamp(k, 0, n - 1);
+  }
+};
+
+typedef PaddedArray2<double> PaddedArray2d;
+typedef PaddedArray2<float> PaddedArray2f;
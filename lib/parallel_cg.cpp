@@ -0,0 +1,160 @@
+#include "parallel_cg.hpp"
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+void ParallelConjugateGradient::set_colors(std::vector<int> const &colors) {
+  red_rows.clear();
+  black_rows.clear();
+  for (int i = 0; i < static_cast<int>(colors.size()); i++)
+    (colors[i] == 0 ? red_rows : black_rows).push_back(i);
+}
+
+int ParallelConjugateGradient::thread_count() {
+#ifdef _OPENMP
+  return (threads > 0) ? threads : omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+/** out = A * in, one row per thread at a time */
+void ParallelConjugateGradient::multiply(Matrix const &A,
+                                         Eigen::VectorXd const &in,
+                                         Eigen::VectorXd &out) {
+  int const *outer = A.outerIndexPtr();
+  int const *inner = A.innerIndexPtr();
+  double const *values = A.valuePtr();
+  int n = A.rows();
+#pragma omp parallel for num_threads(thread_count()) schedule(static)
+  for (int row = 0; row < n; row++) {
+    double sum = 0;
+    for (int k = outer[row]; k < outer[row + 1]; k++)
+      sum += values[k] * in(inner[k]);
+    out(row) = sum;
+  }
+}
+
+double ParallelConjugateGradient::dot(Eigen::VectorXd const &a,
+                                      Eigen::VectorXd const &b) {
+  double sum = 0;
+  int n = a.size();
+#pragma omp parallel for num_threads(thread_count()) schedule(static)          \
+    reduction(+ : sum)
+  for (int i = 0; i < n; i++)
+    sum += a(i) * b(i);
+  return sum;
+}
+
+void ParallelConjugateGradient::remove_mean(Eigen::VectorXd &a) {
+  double sum = 0;
+  int n = a.size();
+#pragma omp parallel for num_threads(thread_count()) schedule(static)          \
+    reduction(+ : sum)
+  for (int i = 0; i < n; i++)
+    sum += a(i);
+  double mean = sum / n;
+#pragma omp parallel for num_threads(thread_count()) schedule(static)
+  for (int i = 0; i < n; i++)
+    a(i) -= mean;
+}
+
+/** Solves each of the given rows for its own unknown, holding the others
+ * fixed. None of the rows may couple to each other. */
+void ParallelConjugateGradient::relax(Matrix const &A,
+                                      std::vector<int> const &rows,
+                                      Eigen::VectorXd const &rhs,
+                                      Eigen::VectorXd &out) {
+  int const *outer = A.outerIndexPtr();
+  int const *inner = A.innerIndexPtr();
+  double const *values = A.valuePtr();
+  int n = rows.size();
+#pragma omp parallel for num_threads(thread_count()) schedule(static)
+  for (int k = 0; k < n; k++) {
+    int row = rows[k];
+    double sum = rhs(row);
+    for (int e = outer[row]; e < outer[row + 1]; e++) {
+      if (inner[e] != row)
+        sum -= values[e] * out(inner[e]);
+    }
+    out(row) = sum * inverse_diagonal(row);
+  }
+}
+
+/** one symmetric red-black Gauss-Seidel sweep on A out = in, from out = 0 */
+void ParallelConjugateGradient::precondition(Matrix const &A,
+                                             Eigen::VectorXd const &in,
+                                             Eigen::VectorXd &out) {
+  out.setZero();
+  relax(A, red_rows, in, out);
+  relax(A, black_rows, in, out);
+  relax(A, red_rows, in, out);
+}
+
+/** The loop and stopping criterion follow Eigen's ConjugateGradient */
+void ParallelConjugateGradient::solve(Matrix const &A,
+                                      Eigen::VectorXd const &b,
+                                      Eigen::VectorXd &x, double tolerance,
+                                      int max_iterations) {
+  int n = A.rows();
+  inverse_diagonal.resize(n);
+  r.resize(n);
+  z.resize(n);
+  p.resize(n);
+  q.resize(n);
+  for (int row = 0; row < n; row++) {
+    double diagonal = A.coeff(row, row);
+    inverse_diagonal(row) = (diagonal != 0) ? 1.0 / diagonal : 1.0;
+  }
+
+  iterations = 0;
+  double rhs_norm2 = dot(b, b);
+  if (rhs_norm2 == 0) {
+    x.setZero();
+    error = 0;
+    return;
+  }
+  double threshold = tolerance * tolerance * rhs_norm2;
+
+  multiply(A, x, q);
+#pragma omp parallel for num_threads(thread_count()) schedule(static)
+  for (int i = 0; i < n; i++)
+    r(i) = b(i) - q(i);
+  if (project_null_space)
+    remove_mean(r);
+  double residual_norm2 = dot(r, r);
+  if (residual_norm2 < threshold) {
+    error = std::sqrt(residual_norm2 / rhs_norm2);
+    return;
+  }
+
+  precondition(A, r, p);
+  if (project_null_space)
+    remove_mean(p);
+  double rho = dot(r, p);
+  while (iterations < max_iterations) {
+    multiply(A, p, q);
+    double alpha = rho / dot(p, q);
+#pragma omp parallel for num_threads(thread_count()) schedule(static)
+    for (int i = 0; i < n; i++) {
+      x(i) += alpha * p(i);
+      r(i) -= alpha * q(i);
+    }
+    iterations++;
+    residual_norm2 = dot(r, r);
+    if (residual_norm2 < threshold)
+      break;
+
+    precondition(A, r, z);
+    if (project_null_space)
+      remove_mean(z);
+    double rho_new = dot(r, z);
+    double beta = rho_new / rho;
+    rho = rho_new;
+#pragma omp parallel for num_threads(thread_count()) schedule(static)
+    for (int i = 0; i < n; i++)
+      p(i) = z(i) + beta * p(i);
+  }
+  error = std::sqrt(residual_norm2 / rhs_norm2);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <eigen3/Eigen/SparseCore>
+#include <vector>
+
+/** \class ParallelConjugateGradient
+ * A conjugate gradient solver whose matrix products, vector updates and dot
+ * products are split across threads with OpenMP. The matrix is row-major, so
+ * every thread writes its own rows of a product.
+ *
+ * The preconditioner is one symmetric red-black Gauss-Seidel sweep started from
+ * zero: red unknowns, then black, then red again. On the 5-point stencil cells
+ * of one color only couple to cells of the other color, so every half sweep
+ * updates its rows in parallel, while still preconditioning much better than a
+ * diagonal scaling.
+ */
+class ParallelConjugateGradient {
+public:
+  typedef Eigen::SparseMatrix<double, Eigen::RowMajor> Matrix;
+
+  int threads = 0; // number of threads, 0 lets OpenMP decide
+  bool project_null_space = false; // keep residuals and search directions
+                                   // free of the constant vector
+
+  int iterations = 0; // iterations used by the last solve
+  double error = 0;   // relative residual reached by the last solve
+
+  /** Splits the unknowns into red (color 0) and black (color 1) rows. This
+   * only depends on the layout of the system, so it is done once. */
+  void set_colors(std::vector<int> const &colors);
+
+  /** Solves Ax = b until |b - Ax| / |b| < tolerance. x holds the initial
+   * guess on entry and the solution on exit. */
+  void solve(Matrix const &A, Eigen::VectorXd const &b, Eigen::VectorXd &x,
+             double tolerance, int max_iterations);
+
+private:
+  std::vector<int> red_rows, black_rows;
+  Eigen::VectorXd inverse_diagonal, r, z, p, q; // reused between solves
+
+  int thread_count();
+  void multiply(Matrix const &A, Eigen::VectorXd const &in,
+                Eigen::VectorXd &out);
+  double dot(Eigen::VectorXd const &a, Eigen::VectorXd const &b);
+  void remove_mean(Eigen::VectorXd &a);
+  void relax(Matrix const &A, std::vector<int> const &rows,
+             Eigen::VectorXd const &rhs, Eigen::VectorXd &out);
+  void precondition(Matrix const &A, Eigen::VectorXd const &in,
+                    Eigen::VectorXd &out);
+};
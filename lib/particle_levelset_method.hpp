@@ -4,12 +4,23 @@
 #include <glm/gtc/random.hpp>
 using namespace glm;
 
+/** batch.values[k] = f.phi at particle k */
+void sample_phi(Fluid &f, SampleBatch &batch) {
+  int n = f.particles.size();
+  batch.resize(n);
+  for (int k = 0; k < n; k++)
+    batch.set_position(k, f.particles[k].position);
+  f.phi.values_at(batch.x.data(), batch.y.data(), batch.values.data(), n);
+}
+
 // TODO remove solid phi
-void reseed_particles(Fluid &f, Array2f solid_phi) {
+void reseed_particles(Fluid &f, Array2f const &solid_phi,
+                      SampleBatch &batch) {
   /* start by removing invalid particles */
-  for (auto &p : f.particles) {
-    float local_phi = f.phi.value_at(p.position);
-    p.valid = (abs(local_phi) < 3.f * f.phi.h);
+  sample_phi(f, batch);
+  for (int k = 0; k < static_cast<int>(f.particles.size()); k++) {
+    float local_phi = batch.values[k];
+    f.particles[k].valid = (abs(local_phi) < 3.f * f.phi.h);
   }
   f.particles.erase(std::remove_if(f.particles.begin(), f.particles.end(),
                                    [](Particle const &p) { return !p.valid; }),
@@ -23,14 +34,12 @@ void reseed_particles(Fluid &f, Array2f solid_phi) {
   }
 
   /* seed new particles to non-full voxels */
-  for (int i = 0; i < f.phi.size(); i++) {
-    // FIXME
-    vec2 ij = f.phi.ij_from_index(i);
-    if (abs(f.phi(i)) > 3.f * f.phi.h || ij.x < 2 || ij.y < 2 ||
-        ij.x > f.phi.sx - 3 || ij.y > f.phi.sy - 3 || solid_phi(i) <= 0)
-      continue;
-    while (f.particle_count(i) < 16) {
-      vec2 position = f.particle_count.wp_from_index(i) +
+  f.phi.for_each_ij([&](int i, int j) {
+    if (abs(f.phi.unchecked(i, j)) > 3.f * f.phi.h || i < 2 || j < 2 ||
+        i > f.phi.sx - 3 || j > f.phi.sy - 3 || solid_phi.unchecked(i, j) <= 0)
+      return;
+    while (f.particle_count.unchecked(i, j) < 16) {
+      vec2 position = f.particle_count.worldspace_of(i, j) +
                       linearRand(vec2(0), vec2(f.phi.h));
       float initial_phi = f.phi.value_at(position);
       float goal_phi =
@@ -45,9 +54,12 @@ void reseed_particles(Fluid &f, Array2f solid_phi) {
       float new_phi = f.phi.value_at(new_position);
       float radius = clamp(abs(new_phi), 0.1f * f.phi.h, 0.5f * f.phi.h);
       f.particles.push_back(Particle(new_position, new_phi, radius));
-      f.particle_count(i) += 1;
+      f.particle_count.unchecked(i, j) += 1;
     }
-  }
+  });
+  /* the substeps up to the next reseeding sample every particle, so the
+   * batch grows here, along with the particles, instead of in one of them */
+  batch.resize(f.particles.size());
 }
 
 void adjust_particle_radii(Fluid &f) {
@@ -57,13 +69,19 @@ void adjust_particle_radii(Fluid &f) {
   }
 }
 
-/** Correct a levelset using the particle level set method */
-void correct_levelset(Fluid &f) {
+/** Correct a levelset using the particle level set method, with phi+ and phi-
+ * held in buffers of scratch and phi sampled at the particles in one batch */
+void correct_levelset(Fluid &f, ScratchPool<float> &scratch,
+                      SampleBatch &batch) {
   /* Compute phi+ and phi- */
-  Array2f phi_minus(f.phi);
-  Array2f phi_plus(f.phi);
-  for (auto &p : f.particles) {
-    float local_phi = f.phi.value_at(p.position);
+  auto scratch_minus = scratch.copy_of(f.phi);
+  auto scratch_plus = scratch.copy_of(f.phi);
+  Array2f &phi_minus = *scratch_minus;
+  Array2f &phi_plus = *scratch_plus;
+  sample_phi(f, batch);
+  for (int k = 0; k < static_cast<int>(f.particles.size()); k++) {
+    Particle &p = f.particles[k];
+    float local_phi = batch.values[k];
     if (p.starting_phi * local_phi >= 0 || abs(local_phi) < p.radius)
       continue;
     float sign_p = (p.starting_phi > 0) ? 1.f : -1.f;
@@ -83,22 +101,30 @@ void correct_levelset(Fluid &f) {
     }
   }
   /* Merge phi+ and phi- */
-  for (int i = 0; i < f.phi.size(); i++) {
-    if (abs(phi_plus(i)) >= abs(phi_minus(i))) {
-      f.phi(i) = phi_minus(i);
-    } else {
-      f.phi(i) = phi_plus(i);
-    }
-  }
+  f.phi.for_each_ij([&](int i, int j) {
+    float plus = phi_plus.unchecked(i, j);
+    float minus = phi_minus.unchecked(i, j);
+    f.phi.unchecked(i, j) = (abs(plus) >= abs(minus)) ? minus : plus;
+  });
 }
 
-void advect_particles(Fluid &f, VelocityField &vel, Array2f &solid_phi,
-                      float dt) {
-  for (auto &p : f.particles) {
-    p.position = rk4(p.position, vel, dt);
-    if (solid_phi.value_at(p.position) < 0.0) {
-      p.position -= solid_phi.value_at(p.position) *
-                    interpolate_gradient(solid_phi, p.position);
+/** moves the particles with rk4_batch, pushing those that end up inside a
+ * solid back out */
+void advect_particles(Fluid &f, VelocityField const &vel,
+                      Array2f const &solid_phi, float dt, SampleBatch &batch) {
+  int n = f.particles.size();
+  batch.resize(n);
+  for (int k = 0; k < n; k++)
+    batch.set_position(k, f.particles[k].position);
+  rk4_batch(vel, dt, batch);
+  solid_phi.values_at(batch.x.data(), batch.y.data(), batch.values.data(), n);
+  for (int k = 0; k < n; k++) {
+    Particle &p = f.particles[k];
+    p.position = batch.position(k);
+    float local_solid_phi = batch.values[k];
+    if (local_solid_phi < 0.0) {
+      p.position -=
+          local_solid_phi * interpolate_gradient(solid_phi, p.position);
     }
     p.position.x =
         clamp(p.position.x, solid_phi.h, (solid_phi.sx - 1.f) * solid_phi.h);
@@ -0,0 +1,316 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include <string>
+
+/** The available backends for the pressure solve. These are selected with the
+ * "pressure_solver" entry in config.json */
+enum class PressureSolverType {
+  CG,             // Eigen's conjugate gradient with a diagonal preconditioner
+  MIC_CG,         // conjugate gradient preconditioned with MIC(0)
+  MULTIGRID,      // geometric multigrid V-cycles on the cell grid
+  MGPCG,          // CG preconditioned with one multigrid V-cycle
+  MATRIX_FREE_CG, // jacobi preconditioned CG without an assembled matrix
+  MIXED_CG,       // single precision CG inside double precision refinement
+  PARALLEL_CG,    // multithreaded CG, red-black Gauss-Seidel preconditioned
+  SOR,            // a fixed number of red-black SOR sweeps on the cell grid
+  FFT,            // cosine transform solve, or CG preconditioned with it
+  LDLT            // sparse LDLT factorization, refactorized only on change
+};
+
+/** How the initial guess of each pressure solve is chosen */
+enum class WarmStart {
+  NONE,       // start from zero
+  PREVIOUS,   // start from the pressure of the previous substep
+  EXTRAPOLATE // extrapolate linearly from the last two pressures
+};
+
+/** How the constant null space of the closed box is treated */
+enum class NullSpace {
+  NONE,    // leave it to the solver, which may then miss its tolerance
+  PROJECT, // remove the mean of the right hand side and of the iterates
+  PIN      // fix the pressure of one reference cell to 0
+};
+
+/** converts a config string to a solver type, defaulting to plain CG */
+inline PressureSolverType pressure_solver_from_string(std::string const &name) {
+  if (name == "mic_cg")
+    return PressureSolverType::MIC_CG;
+  if (name == "multigrid")
+    return PressureSolverType::MULTIGRID;
+  if (name == "mgpcg")
+    return PressureSolverType::MGPCG;
+  if (name == "matrix_free_cg")
+    return PressureSolverType::MATRIX_FREE_CG;
+  if (name == "mixed_cg")
+    return PressureSolverType::MIXED_CG;
+  if (name == "parallel_cg")
+    return PressureSolverType::PARALLEL_CG;
+  if (name == "sor")
+    return PressureSolverType::SOR;
+  if (name == "fft")
+    return PressureSolverType::FFT;
+  if (name == "ldlt")
+    return PressureSolverType::LDLT;
+  if (name != "cg")
+    printf("~~ unknown pressure solver %s, falling back to cg\n",
+           name.c_str());
+  return PressureSolverType::CG;
+}
+
+inline std::string pressure_solver_name(PressureSolverType type) {
+  switch (type) {
+  case PressureSolverType::MIC_CG:
+    return "mic_cg";
+  case PressureSolverType::MULTIGRID:
+    return "multigrid";
+  case PressureSolverType::MGPCG:
+    return "mgpcg";
+  case PressureSolverType::MATRIX_FREE_CG:
+    return "matrix_free_cg";
+  case PressureSolverType::MIXED_CG:
+    return "mixed_cg";
+  case PressureSolverType::PARALLEL_CG:
+    return "parallel_cg";
+  case PressureSolverType::SOR:
+    return "sor";
+  case PressureSolverType::FFT:
+    return "fft";
+  case PressureSolverType::LDLT:
+    return "ldlt";
+  default:
+    return "cg";
+  }
+}
+
+inline WarmStart warm_start_from_string(std::string const &name) {
+  if (name == "previous")
+    return WarmStart::PREVIOUS;
+  if (name == "extrapolate")
+    return WarmStart::EXTRAPOLATE;
+  if (name != "none")
+    printf("~~ unknown warm start %s, starting from zero\n", name.c_str());
+  return WarmStart::NONE;
+}
+
+inline std::string warm_start_name(WarmStart warm_start) {
+  switch (warm_start) {
+  case WarmStart::PREVIOUS:
+    return "previous";
+  case WarmStart::EXTRAPOLATE:
+    return "extrapolate";
+  default:
+    return "none";
+  }
+}
+
+inline NullSpace null_space_from_string(std::string const &name) {
+  if (name == "none")
+    return NullSpace::NONE;
+  if (name == "pin")
+    return NullSpace::PIN;
+  if (name != "project")
+    printf("~~ unknown null space handling %s, projecting\n", name.c_str());
+  return NullSpace::PROJECT;
+}
+
+inline std::string null_space_name(NullSpace null_space) {
+  switch (null_space) {
+  case NullSpace::PROJECT:
+    return "project";
+  case NullSpace::PIN:
+    return "pin";
+  default:
+    return "none";
+  }
+}
+
+/** whether a backend solves with the assembled Eigen matrix */
+inline bool uses_assembled_matrix(PressureSolverType type) {
+  return type == PressureSolverType::CG || type == PressureSolverType::MIC_CG ||
+         type == PressureSolverType::MIXED_CG ||
+         type == PressureSolverType::PARALLEL_CG ||
+         type == PressureSolverType::LDLT;
+}
+
+/** whether a backend needs the multigrid hierarchy */
+inline bool uses_multigrid(PressureSolverType type) {
+  return type == PressureSolverType::MULTIGRID ||
+         type == PressureSolverType::MGPCG;
+}
+
+/** whether a backend can hold the cells of a free surface at p = 0 */
+inline bool supports_free_surface(PressureSolverType type) {
+  return uses_assembled_matrix(type) || uses_multigrid(type);
+}
+
+/** \class PressureSolverSettings
+ * user-facing parameters of the pressure solve
+ * - type: which backend solves the linear system
+ * - warm_start: how the initial guess is chosen
+ * - null_space: how the constant pressure mode is handled by the backends that
+ *   solve the assembled matrix, projected out by default (multigrid and
+ *   matrix_free_cg always project, ldlt always pins and then projects if
+ *   asked to)
+ * - mic_tau: the modification parameter of MIC(0), 0 gives plain IC(0)
+ * - mic_sigma: safety factor used when a MIC(0) pivot gets too small
+ * - multigrid_tolerance: relative residual at which multigrid and mgpcg stop
+ * - multigrid_max_cycles: upper bound on the number of V-cycles (for mgpcg,
+ *   one per CG iteration)
+ * - mixed_tolerance: relative residual, measured in double precision, at which
+ *   mixed_cg stops refining
+ * - mixed_inner_tolerance: relative residual each single precision CG solve of
+ *   mixed_cg reduces its correction's residual to
+ * - mixed_max_refinements: upper bound on the number of corrections
+ * - threads: number of threads used by parallel_cg and sor, 0 uses every core
+ * - sor_sweeps: the fixed number of red-black sweeps of every sor solve
+ * - sor_omega: relaxation factor of sor, 0 picks the optimal one for the grid
+ * - sor_chebyshev: whether sor varies its relaxation factor (Chebyshev
+ *   acceleration), sor_omega then only caps it
+ * - fft_tolerance: relative residual at which the preconditioned CG of fft
+ *   stops when the densities differ
+ * - fft_max_iterations: upper bound on its number of iterations
+ * - tolerance: relative residual at which every backend stops, 0 keeps each
+ *   backend's own (multigrid_tolerance, mixed_tolerance, fft_tolerance, and
+ *   near machine precision for the conjugate gradients)
+ * - adaptive_tolerance: derive the tolerance of every substep from its
+ *   divergence and length instead (see adaptive_tolerance())
+ * - volume_error: the fraction of a cell's volume the divergence left by an
+ *   adaptive solve may move during its substep
+ * - free_surface: index of the fluid treated as a p = 0 region (usually
+ *   air), whose cells then drop out of the system, -1 for none. This works
+ *   with the assembled matrix backends and multigrid, the others fall back to
+ *   mgpcg, and it makes null_space moot
+ * - max_iterations: caps the iterations (cycles, sweeps, refinements) of every
+ *   backend below its own limit, 0 keeps the backend's limit
+ * - save_snapshots: writes the state the first pressure solve of each frame
+ *   starts from to plot/data, for the pressure benchmark
+ * - log_solves: appends the metrics of every pressure solve to
+ *   plot/data/solves.txt */
+struct PressureSolverSettings {
+  PressureSolverType type = PressureSolverType::CG;
+  WarmStart warm_start = WarmStart::NONE;
+  NullSpace null_space = NullSpace::PROJECT;
+  double mic_tau = 0.97;
+  double mic_sigma = 0.25;
+  double multigrid_tolerance = 1e-6;
+  int multigrid_max_cycles = 100;
+  double mixed_tolerance = 1e-10;
+  double mixed_inner_tolerance = 1e-4;
+  int mixed_max_refinements = 10;
+  int threads = 0;
+  int sor_sweeps = 100;
+  double sor_omega = 0;
+  bool sor_chebyshev = true;
+  double fft_tolerance = 1e-8;
+  int fft_max_iterations = 200;
+  double tolerance = 0;
+  bool adaptive_tolerance = false;
+  double volume_error = 1e-5;
+  int free_surface = -1;
+  int max_iterations = 0;
+  bool save_snapshots = false;
+  bool log_solves = false;
+
+  /** whether the domain is closed, so the pressure is only determined up to a
+   * constant. A free surface fixes it. */
+  bool closed() const { return free_surface < 0; }
+
+  /** the fixed tolerance of a backend whose own is backend_tolerance */
+  double tolerance_for(double backend_tolerance) const {
+    return (tolerance > 0) ? tolerance : backend_tolerance;
+  }
+
+  /** the iteration limit of a backend whose own limit is backend_limit */
+  int iteration_limit(int backend_limit) const {
+    return (max_iterations > 0) ? std::min(max_iterations, backend_limit)
+                                : backend_limit;
+  }
+
+  void print_information() {
+    printf("~~ Pressure solver information ~~\n type: %s\n warm start: %s\n"
+           " null space: %s\n",
+           pressure_solver_name(type).c_str(),
+           warm_start_name(warm_start).c_str(),
+           null_space_name(null_space).c_str());
+    if (!closed())
+      printf(" free surface: fluid %i\n", free_surface);
+  }
+};
+
+/** The relative residual at which a pressure solve may stop so that the
+ * divergence it leaves behind moves, in the root mean square over the cells, at
+ * most volume_error of a cell's volume during the substep. The right hand side
+ * is the divergence over dt, and so is the residual, so the leftover
+ * divergence r * dt displaces r * dt^2 of a cell per substep:
+ *   |r| / |b| <= volume_error * sqrt(unknowns) / (dt^2 |b|)
+ * Short substeps and nearly divergence free velocities thus get loose
+ * tolerances. The result is kept between 1e-10, about what the roundoff of
+ * the singular system allows, and 0.1. */
+inline double adaptive_tolerance(double volume_error, double dt,
+                                 double rhs_norm, int unknowns) {
+  if (rhs_norm == 0 || dt == 0)
+    return 0.1;
+  double tolerance =
+      volume_error * std::sqrt(static_cast<double>(unknowns)) /
+      (dt * dt * rhs_norm);
+  return std::clamp(tolerance, 1e-10, 0.1);
+}
+
+/** \class SolveMetrics
+ * what a single pressure solve did, handed to Simulation::on_pressure_solve
+ * after every substep */
+struct SolveMetrics {
+  int frame = 0;   // frame the substep belongs to
+  int substep = 0; // index of the solve within its frame
+  float dt = 0;    // length of the substep
+  PressureSolverType type = PressureSolverType::CG;
+  int unknowns = 0;         // size of the linear system
+  int iterations = 0;       // iterations, V-cycles or sweeps of the backend
+  int max_iterations = 0;   // the limit the backend was given
+  bool reached_cap = false; // stopped at max_iterations without converging
+  double tolerance = 0;     // relative residual the backend aimed for
+  double error = 0;         // relative residual reported by the backend
+  double setup_seconds = 0; // building the layout, face coefficients and rhs
+  double solve_seconds = 0; // the backend, including its coefficient update
+};
+
+/** \class SolverStats
+ * accumulates convergence information of the pressure solves performed over a
+ * frame so that different backends can be compared */
+struct SolverStats {
+  int solves = 0;           // number of pressure solves
+  int total_iterations = 0; // sum of iterations over all solves
+  int max_iterations = 0;   // largest iteration count of a single solve
+  double max_error = 0;     // largest relative residual reported by a solve
+  double max_mean = 0; // largest mean pressure, the drift along the null space
+  int capped = 0;      // solves that stopped at their iteration limit
+  double solve_seconds = 0; // time spent in the backends
+
+  void record(SolveMetrics const &metrics) {
+    solves++;
+    total_iterations += metrics.iterations;
+    max_iterations = std::max(max_iterations, metrics.iterations);
+    max_error = std::max(max_error, metrics.error);
+    capped += metrics.reached_cap ? 1 : 0;
+    solve_seconds += metrics.solve_seconds;
+  }
+
+  void record_mean(double mean) {
+    max_mean = std::max(max_mean, std::abs(mean));
+  }
+
+  void reset() { *this = SolverStats(); }
+
+  void print_information() {
+    if (solves == 0)
+      return;
+    printf("    %i pressure solves in %.3fs, iterations avg: %.1f max: %i, "
+           "max residual: %.2e, max mean pressure: %.2e\n",
+           solves, solve_seconds, static_cast<float>(total_iterations) / solves,
+           max_iterations, max_error, max_mean);
+    if (capped > 0)
+      printf("    %i of them stopped at the iteration limit\n", capped);
+  }
+};
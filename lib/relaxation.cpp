@@ -0,0 +1,90 @@
+#include "relaxation.hpp"
+#include <algorithm>
+#include <cmath>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+int RedBlackSOR::thread_count() {
+#ifdef _OPENMP
+  return (threads > 0) ? threads : omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+/** Over-relaxes every active cell of one color towards its Gauss-Seidel
+ * value */
+void RedBlackSOR::half_sweep(Array2f &solid_phi, Array2d &bu, Array2d &bv,
+                             Array2d &b, Array2d &x, int color, double w) {
+  int sx = x.sx;
+  int sy = x.sy;
+#pragma omp parallel for num_threads(thread_count()) schedule(static)
+  for (int j = 0; j < sy; j++) {
+    for (int i = (j + color) % 2; i < sx; i += 2) {
+      if (solid_phi(i, j) <= 0)
+        continue;
+      double diagonal = bu(i, j) + bu(i + 1, j) + bv(i, j) + bv(i, j + 1);
+      if (diagonal == 0)
+        continue;
+      double sum = bu(i, j) * x(i - 1, j) + bu(i + 1, j) * x(i + 1, j) +
+                   bv(i, j) * x(i, j - 1) + bv(i, j + 1) * x(i, j + 1);
+      double gauss_seidel = (sum - b(i, j)) / diagonal;
+      x(i, j) += w * (gauss_seidel - x(i, j));
+    }
+  }
+}
+
+double RedBlackSOR::residual_norm(Array2f &solid_phi, Array2d &bu,
+                                  Array2d &bv, Array2d &b, Array2d &x) {
+  int sx = x.sx;
+  int sy = x.sy;
+  double norm = 0;
+#pragma omp parallel for num_threads(thread_count()) schedule(static)          \
+    reduction(+ : norm)
+  for (int j = 0; j < sy; j++) {
+    for (int i = 0; i < sx; i++) {
+      if (solid_phi(i, j) <= 0)
+        continue;
+      double center = x(i, j);
+      double Ax = bu(i, j) * (x(i - 1, j) - center) +
+                  bu(i + 1, j) * (x(i + 1, j) - center) +
+                  bv(i, j) * (x(i, j - 1) - center) +
+                  bv(i, j + 1) * (x(i, j + 1) - center);
+      norm += (b(i, j) - Ax) * (b(i, j) - Ax);
+    }
+  }
+  return std::sqrt(norm);
+}
+
+void RedBlackSOR::solve(Array2f &solid_phi, Array2d &bu, Array2d &bv,
+                        Array2d &b, Array2d &x, int sweeps) {
+  /* the spectral radius of jacobi iteration for the poisson equation on the
+   * grid, which the variable coefficients only perturb */
+  int n = std::max(x.sx, x.sy);
+  double rho = std::cos(M_PI / n);
+  double optimal = 2.0 / (1.0 + std::sqrt(1.0 - rho * rho));
+  double w = chebyshev ? 1.0 : ((omega > 0) ? omega : optimal);
+
+  for (iterations = 0; iterations < sweeps; iterations++) {
+    for (int color = 0; color < 2; color++) {
+      half_sweep(solid_phi, bu, bv, b, x, color, w);
+      if (!chebyshev)
+        continue;
+      if (iterations == 0 && color == 0)
+        w = 1.0 / (1.0 - 0.5 * rho * rho);
+      else
+        w = 1.0 / (1.0 - 0.25 * rho * rho * w);
+      if (omega > 0)
+        w = std::min(w, omega);
+    }
+  }
+
+  double b_norm = 0;
+  for (int i = 0; i < b.size(); i++) {
+    if (solid_phi(i) > 0)
+      b_norm += b(i) * b(i);
+  }
+  b_norm = std::sqrt(b_norm);
+  error = (b_norm > 0) ? residual_norm(solid_phi, bu, bv, b, x) / b_norm : 0;
+}
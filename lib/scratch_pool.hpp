@@ -0,0 +1,76 @@
+#pragma once
+#include "array2.hpp"
+#include <memory>
+#include <vector>
+
+/** \class ScratchPool
+ * Reusable Array2 buffers of the given Layout for the full-grid temporaries
+ * of a substep. acquire hands out a free buffer of the requested shape,
+ * allocating one only when there is none, and the Scratch it returns gives
+ * the buffer back when it goes out of scope. After the first substep has
+ * created one buffer per temporary alive at the same time, later substeps
+ * allocate nothing.
+ *
+ * The contents of an acquired buffer are whatever its last user left there.
+ */
+template <class T, class Layout = DenseRows> class ScratchPool {
+public:
+  class Scratch {
+  public:
+    Scratch(ScratchPool *pool_, int index_) : pool(pool_), index(index_) {}
+    Scratch(Scratch &&other) : pool(other.pool), index(other.index) {
+      other.pool = nullptr;
+    }
+    Scratch(Scratch const &) = delete;
+    Scratch &operator=(Scratch const &) = delete;
+    ~Scratch() {
+      if (pool)
+        pool->in_use[index] = false;
+    }
+
+    Array2<T, Layout> &operator*() { return *pool->buffers[index]; }
+    Array2<T, Layout> *operator->() { return pool->buffers[index].get(); }
+
+  private:
+    ScratchPool *pool;
+    int index;
+  };
+
+  /** a buffer of sx by sy cells with the given offsets and cell size */
+  Scratch acquire(int sx, int sy, float offset_x, float offset_y, float h) {
+    int n = buffers.size();
+    for (int k = 0; k < n; k++) {
+      Array2<T, Layout> &buffer = *buffers[k];
+      if (in_use[k] || buffer.sx != sx || buffer.sy != sy)
+        continue;
+      buffer.offset_x = offset_x;
+      buffer.offset_y = offset_y;
+      buffer.h = h;
+      in_use[k] = true;
+      return Scratch(this, k);
+    }
+    buffers.push_back(
+        std::make_unique<Array2<T, Layout>>(sx, sy, offset_x, offset_y, h));
+    in_use.push_back(true);
+    return Scratch(this, n);
+  }
+
+  /** a buffer of the shape of like, not a copy of its values */
+  Scratch acquire(Array2<T, Layout> const &like) {
+    return acquire(like.sx, like.sy, like.offset_x, like.offset_y, like.h);
+  }
+
+  /** a buffer holding a copy of a */
+  Scratch copy_of(Array2<T, Layout> const &a) {
+    Scratch scratch = acquire(a);
+    std::copy(a.data.begin(), a.data.end(), scratch->data.begin());
+    return scratch;
+  }
+
+  /** how many buffers the pool has allocated */
+  int allocations() const { return buffers.size(); }
+
+private:
+  std::vector<std::unique_ptr<Array2<T, Layout>>> buffers;
+  std::vector<bool> in_use;
+};
@@ -49,6 +49,72 @@ void initialize_simulation(Simulation &sim) {
            rxn_json["reactant2"].get<int>() - 1,
            rxn_json["product"].get<int>() - 1, rxn_json["rate"].get<float>());
 
+  // choose the pressure solver, plain cg unless otherwise specified
+  if (j.contains("pressure_solver")) {
+    auto solver_json = j["pressure_solver"].get<json>();
+    sim.solver_settings.type = pressure_solver_from_string(
+        solver_json.value("type", std::string("cg")));
+    sim.solver_settings.warm_start = warm_start_from_string(
+        solver_json.value("warm_start", std::string("none")));
+    sim.solver_settings.null_space = null_space_from_string(
+        solver_json.value("null_space", std::string("project")));
+    sim.solver_settings.mic_tau = solver_json.value("mic_tau", 0.97);
+    sim.solver_settings.mic_sigma = solver_json.value("mic_sigma", 0.25);
+    sim.solver_settings.multigrid_tolerance =
+        solver_json.value("multigrid_tolerance", 1e-6);
+    sim.solver_settings.multigrid_max_cycles =
+        solver_json.value("multigrid_max_cycles", 100);
+    sim.solver_settings.mixed_tolerance =
+        solver_json.value("mixed_tolerance", 1e-10);
+    sim.solver_settings.mixed_inner_tolerance =
+        solver_json.value("mixed_inner_tolerance", 1e-4);
+    sim.solver_settings.mixed_max_refinements =
+        solver_json.value("mixed_max_refinements", 10);
+    sim.solver_settings.threads = solver_json.value("threads", 0);
+    sim.solver_settings.sor_sweeps = solver_json.value("sor_sweeps", 100);
+    sim.solver_settings.sor_omega = solver_json.value("sor_omega", 0.0);
+    sim.solver_settings.sor_chebyshev =
+        solver_json.value("sor_chebyshev", true);
+    sim.solver_settings.fft_tolerance =
+        solver_json.value("fft_tolerance", 1e-8);
+    sim.solver_settings.fft_max_iterations =
+        solver_json.value("fft_max_iterations", 200);
+    sim.solver_settings.tolerance = solver_json.value("tolerance", 0.0);
+    sim.solver_settings.adaptive_tolerance =
+        solver_json.value("adaptive_tolerance", false);
+    sim.solver_settings.volume_error = solver_json.value("volume_error", 1e-5);
+    sim.solver_settings.max_iterations = solver_json.value("max_iterations", 0);
+    // the fluid named by "free_surface" is held at p = 0
+    auto free_surface =
+        solver_json.value("free_surface", std::string("none"));
+    int n = 0;
+    for (auto &fluid : j["fluids"]) {
+      if (fluid["name"].get<std::string>() == free_surface)
+        sim.solver_settings.free_surface = n;
+      n++;
+    }
+    if (free_surface != "none" && sim.solver_settings.closed())
+      printf("~~ no fluid named %s for the free surface, ignoring it\n",
+             free_surface.c_str());
+    sim.solver_settings.save_snapshots =
+        solver_json.value("save_snapshots", false);
+    sim.solver_settings.log_solves = solver_json.value("log_solves", false);
+  }
+
+  // one line per pressure solve, see SolveMetrics
+  if (sim.solver_settings.log_solves) {
+    std::ofstream("plot/data/solves.txt")
+        << "#frame\tsubstep\tdt\tunknowns\titerations\tmax_iterations\t"
+           "reached_cap\ttolerance\terror\tsetup_s\tsolve_s\n";
+    sim.on_pressure_solve = [](SolveMetrics const &m) {
+      std::ofstream file("plot/data/solves.txt", std::ios::app);
+      file << m.frame << "\t" << m.substep << "\t" << m.dt << "\t"
+           << m.unknowns << "\t" << m.iterations << "\t" << m.max_iterations
+           << "\t" << m.reached_cap << "\t" << m.tolerance << "\t" << m.error
+           << "\t" << m.setup_seconds << "\t" << m.solve_seconds << "\n";
+    };
+  }
+
   // add each fluid
   for (auto tmp : j["fluids"].get<json>()) {
     sim.add_fluid(tmp["density"].get<float>());
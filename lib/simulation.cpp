@@ -2,8 +2,7 @@
 #include "export_data.hpp"
 #include "levelset_methods.hpp"
 #include "particle_levelset_method.hpp"
-#include <eigen3/Eigen/IterativeLinearSolvers>
-#include <eigen3/Eigen/SparseCore>
+#include "snapshot.hpp"
 
 /**  Returns a timestep that ensures the simulation is stable */
 float Simulation::cfl() {
@@ -23,7 +22,7 @@ void Simulation::run() {
   // delete old datafiles, fix after initializing
   clear_exported_data();
   for (auto &f : fluids) {
-    reinitialize_phi(f);
+    reinitialize_phi(f, float_scratch);
   }
   project_phi(fluids, solid_phi, vec4(-1, -1, -1, 0.0));
   // advance(std::min(cfl(), 1e-7f));
@@ -70,8 +69,10 @@ void Simulation::run() {
     time_elapsed += timestep;
     printf("[ %3.2fs elapsed ] ", ms / 1000.f);
     export_simulation_data(p, vel, fluids, time_elapsed, frame_number);
+    solver_stats.print_information();
+    solver_stats.reset();
   }
-  for (auto f : fluids) {
+  for (auto &f : fluids) {
     f.print_information();
   }
 }
@@ -81,14 +82,14 @@ void Simulation::run() {
 void Simulation::advance(float dt) {
   assert(dt > 0);
   for (auto &f : fluids) {
-    advect_phi(u, v, f.phi, dt);
-    advect_particles(f, vel, solid_phi, dt);
-    correct_levelset(f);
-    reinitialize_phi(f);
-    correct_levelset(f);
+    advect_phi(u, v, f.phi, dt, float_scratch);
+    advect_particles(f, vel, solid_phi, dt, sample_batch);
+    correct_levelset(f, float_scratch, sample_batch);
+    reinitialize_phi(f, float_scratch);
+    correct_levelset(f, float_scratch, sample_batch);
     adjust_particle_radii(f);
     if (reseed_counter++ % 5 == 0)
-      reseed_particles(f, solid_phi);
+      reseed_particles(f, solid_phi, sample_batch);
   }
   project_phi(fluids, solid_phi, rxn);
 
@@ -101,202 +102,810 @@ void Simulation::advance(float dt) {
   enforce_boundaries();
   solve_pressure(dt);
   apply_pressure_gradient(dt);
+  if (!solver_settings.closed())
+    extrapolate_velocity();
 }
 
 void Simulation::get_fluid_ids() {
-  Array2f min_phi(sx, sy, -0.5, -0.5, h);
+  auto scratch_phi = float_scratch.acquire(sx, sy, -0.5, -0.5, h);
+  Array2f &min_phi = *scratch_phi;
   min_phi.set(99999.9);
 
   for (uint n = 0; n < fluids.size(); n++) {
     auto &f = fluids[n];
-    for (auto it = fluid_id.begin(); it != fluid_id.end(); it++) {
-      vec2 ij = it.ij();
-      if (f.phi(ij) < min_phi(ij)) {
-        min_phi(ij) = f.phi(ij);
-        fluid_id(ij) = n;
+    fluid_id.for_each_ij([&](int i, int j) {
+      if (f.phi.unchecked(i, j) < min_phi.unchecked(i, j)) {
+        min_phi.unchecked(i, j) = f.phi.unchecked(i, j);
+        fluid_id.unchecked(i, j) = n;
       }
-    }
+    });
   }
 }
 
 void Simulation::add_gravity(float dt) {
-  for (auto &face : v.data) {
-    face -= 9.8 * dt;
+  for (int j = 0; j < v.sy; j++) {
+    float *faces = v.row(j);
+    for (int i = 0; i < v.sx; i++)
+      faces[i] -= 9.8 * dt;
   }
 }
 
 void Simulation::advect_velocity(float dt) {
-  Array2f new_u(u);
-  Array2f new_v(v);
-
-  for (auto it = new_u.begin(); it != new_u.end(); it++) {
-    vec2 new_position = rk4(it.wp(), vel, -dt);
-    *it = u.value_at(new_position);
-  }
+  auto scratch_u = face_scratch.acquire(u);
+  auto scratch_v = face_scratch.acquire(v);
+  AlignedArray2f &new_u = *scratch_u;
+  AlignedArray2f &new_v = *scratch_v;
+  // every backtraced sample reads from copies with one clamped ghost layer,
+  // so the bilinear lookups skip the per-read bounds checks of Array2
+  padded_u.assign(u, 1, GhostPolicy::CLAMP);
+  padded_v.assign(v, 1, GhostPolicy::CLAMP);
+  PaddedVelocityField padded_vel(&padded_u, &padded_v);
 
-  for (auto it = new_v.begin(); it != new_v.end(); it++) {
-    vec2 new_position = rk4(it.wp(), vel, -dt);
-    *it = v.value_at(new_position);
-  }
+  /* a row of faces at a time is traced back and sampled as one batch */
+  auto backtrace = [&](AlignedArray2f &velocity, PaddedArray2f const &from) {
+    sample_batch.resize(velocity.sx);
+    for (int j = 0; j < velocity.sy; j++) {
+      for (int i = 0; i < velocity.sx; i++)
+        sample_batch.set_position(i, velocity.worldspace_of(i, j));
+      rk4_batch(padded_vel, -dt, sample_batch);
+      from.values_at(sample_batch.x.data(), sample_batch.y.data(),
+                     velocity.row(j), velocity.sx);
+    }
+  };
+  backtrace(new_u, padded_u);
+  backtrace(new_v, padded_v);
 
-  u = new_u;
-  v = new_v;
+  std::swap(u.data, new_u.data);
+  std::swap(v.data, new_v.data);
 }
 
 /** Sets the velocity on solid boundaries to 0 so that fluids do not flow in or
  * out of solids */
 void Simulation::enforce_boundaries() {
-  for (auto it = solid_phi.begin(); it != solid_phi.end(); it++) {
-    if (*it < 0) {
-      vec2 ij = it.ij();
+  solid_phi.for_each_ij([&](int i, int j) {
+    if (solid_phi.unchecked(i, j) < 0) {
       for (auto &f : fluids) {
-        f.phi(ij) = min(f.phi(ij), 0.5f * f.phi.h);
+        f.phi.unchecked(i, j) = min(f.phi.unchecked(i, j), 0.5f * f.phi.h);
       }
-      u(ij) = 0;
-      u(ij + vec2(1, 0)) = 0;
-      v(ij) = 0;
-      v(ij + vec2(0, 1)) = 0;
+      u.unchecked(i, j) = 0;
+      u.unchecked(i + 1, j) = 0;
+      v.unchecked(i, j) = 0;
+      v.unchecked(i, j + 1) = 0;
     }
-  }
+  });
 }
 
-/* Returns an int array which gives each fluid cell a corresponding nonnegative
- * integer index. Nonfluid cells are marked with a -1 */
-Array2i Simulation::count_fluid_cells() {
-  Array2i fluid_cell_count(sx, sy, -0.5, -0.5, h);
-  fluid_cell_count.set(-1);
+/* Fills cells with an int array which gives each fluid cell a corresponding
+ * nonnegative integer index. Nonfluid cells, and the cells of the free surface
+ * fluid, are marked with a -1 */
+void Simulation::count_fluid_cells(Array2i &cells) {
+  if (cells.sx != sx || cells.sy != sy)
+    cells.init(sx, sy, -0.5, -0.5, h);
+  cells.set(-1);
   int counter = 0;
-  for (int i = 0; i < fluid_cell_count.size(); i++) {
-    if (solid_phi(i) <= 0)
-      continue;
-    fluid_cell_count(i) = counter++;
-  }
+  cells.for_each_ij([&](int i, int j) {
+    if (solid_phi.unchecked(i, j) <= 0 ||
+        fluid_id.unchecked(i, j) == solver_settings.free_surface)
+      return;
+    cells.unchecked(i, j) = counter++;
+  });
   assert(counter > 0);
-  return fluid_cell_count;
 }
 
-/** Returns the density between two voxels, either as naively expected in the
- * case where the voxels contain the same fluid, or as defined in eqn. 55 in Liu
- * et al*/
+/** Returns the density between two voxels, see the free function
+ * sample_density in fluid.hpp. With a free surface, a face between the
+ * free surface fluid and another one gets the ghost fluid coefficient of a
+ * p = 0 interface, b / theta, which is also the limit of sample_density as
+ * the density of the free surface fluid goes to 0. Faces within the free
+ * surface fluid get 0, none of their cells are unknowns. */
 float Simulation::sample_density(vec2 ij, vec2 kl) {
-  if (fluid_id(ij) == fluid_id(kl)) {
-    return 1.f / fluids[fluid_id(ij)].density;
-  } else {
-    int ij_id = fluid_id(ij);
-    int kl_id = fluid_id(kl);
-    float ij_phi = fluids[ij_id].phi(ij);
-    float kl_phi = fluids[kl_id].phi(kl);
-    float b_minus = 1.f / fluids[ij_id].density;
-    float b_plus = 1.f / fluids[kl_id].density;
-    float theta = abs(ij_phi) / (abs(ij_phi) + abs(kl_phi));
-    return (b_minus * b_plus) / (theta * b_plus + (1.f - theta) * b_minus);
+  int surface = solver_settings.free_surface;
+  bool ij_surface = (fluid_id(ij) == surface);
+  bool kl_surface = (fluid_id(kl) == surface);
+  if (!ij_surface && !kl_surface)
+    return ::sample_density(fluid_id, fluids, ij.x, ij.y, kl.x, kl.y);
+  if (ij_surface && kl_surface)
+    return 0;
+  vec2 inside = ij_surface ? kl : ij;
+  vec2 outside = ij_surface ? ij : kl;
+  Fluid &fluid = fluids[fluid_id(inside)];
+  float inside_phi = std::abs(fluid.phi(inside));
+  float outside_phi = std::abs(fluids[surface].phi(outside));
+  float theta = (inside_phi + outside_phi > 0)
+                    ? inside_phi / (inside_phi + outside_phi)
+                    : 0.5f;
+  /* an interface right at the cell center would make the row unbounded */
+  return 1.f / (fluid.density * std::max(theta, 0.01f));
+}
+
+/** Fills the off-diagonal coefficients of the poisson equation for every face
+ * between two non-solid cells, and 0 for every other face. u_coefficients(i, j)
+ * couples cells (i-1, j) and (i, j), v_coefficients(i, j) couples cells
+ * (i, j-1) and (i, j). */
+void Simulation::compute_face_coefficients(Array2d &u_coefficients,
+                                           Array2d &v_coefficients) {
+  float scale = 1.f / (h * h);
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j < sy; j++) {
+    for (int i = 0; i <= sx; i++) {
+      u_coefficients(i, j) = 0;
+      if (i < 1 || i >= sx || solid_phi(i - 1, j) <= 0 || solid_phi(i, j) <= 0)
+        continue;
+      vec2 ij(i, j);
+      u_coefficients(i, j) = scale * sample_density(ij, ij - vec2(1, 0));
+    }
+  }
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j <= sy; j++) {
+    for (int i = 0; i < sx; i++) {
+      v_coefficients(i, j) = 0;
+      if (j < 1 || j >= sy || solid_phi(i, j - 1) <= 0 || solid_phi(i, j) <= 0)
+        continue;
+      vec2 ij(i, j);
+      v_coefficients(i, j) = scale * sample_density(ij, ij - vec2(0, 1));
+    }
   }
 }
 
-/** Assembles a varying coefficient matrix for the possion equation. The lhs is
- * discretized as in eqn. 77 in liu et all */
-Eigen::SparseMatrix<double>
-Simulation::assemble_poisson_coefficient_matrix(Array2i fluid_cell_count,
-                                                int nf) {
-  std::vector<Eigen::Triplet<double>> coefficients;
-  for (int it = 0; it < p.size(); it++) {
-    if (solid_phi(it) <= 0)
-      continue;
-    vec2 ij = p.ij_from_index(it);
-    float scale = 1.f / (h * h);
-    int center_index = fluid_cell_count(ij);
-    float center_coefficient = 0;
-
-    /* loop through all four neighboring cells */
-    for (auto offset : {vec2(1, 0), vec2(-1, 0), vec2(0, 1), vec2(0, -1)}) {
-      vec2 neighbor_position = ij + offset;
-      int neighbor_index = fluid_cell_count(neighbor_position);
-      if (neighbor_index >= 0) {
-        float b_hat = sample_density(ij, neighbor_position);
-        float neighbor_coefficient = scale * b_hat;
-        center_coefficient -= scale * b_hat;
-        coefficients.push_back(Eigen::Triplet<double>(
-            center_index, neighbor_index, neighbor_coefficient));
+/** Assembles the sparsity pattern of the poisson matrix, eqn. 77 in liu et
+ * all, into A with every value 0, cells holding the
+ * index of every unknown or -1. update_poisson_coefficients writes the
+ * values, so that the face coefficients are only turned into a row in one
+ * place. A keeps its buffers when the number of unknowns and entries does not
+ * grow, as across the rebuilds of a free surface. */
+void Simulation::assemble_poisson_pattern(
+    Array2i const &cells, int unknowns, Eigen::SparseMatrix<double> &A) const {
+  /* Every unknown couples to at most its four neighbors, and the pattern is
+   * symmetric, so column c holds the same rows as row c. Cells are numbered in
+   * row-major order, which makes the -y, -x, center, +x, +y entries of a
+   * column already sorted by row. The columns are sized first, then every
+   * column is written in place. */
+  ivec2 const offsets[5] = {ivec2(0, -1), ivec2(-1, 0), ivec2(0, 0),
+                            ivec2(1, 0), ivec2(0, 1)};
+  auto neighbor_index = [&](ivec2 kl) {
+    if (kl.x < 0 || kl.y < 0 || kl.x >= cells.sx || kl.y >= cells.sy)
+      return -1;
+    return cells.unchecked(kl.x, kl.y);
+  };
+
+  A.resize(unknowns, unknowns);
+  int *outer = A.outerIndexPtr();
+  cells.for_each_ij([&](int i, int j) {
+    int center_index = cells.unchecked(i, j);
+    if (center_index < 0)
+      return;
+    int count = 0;
+    for (ivec2 offset : offsets)
+      count += (neighbor_index(ivec2(i, j) + offset) >= 0) ? 1 : 0;
+    outer[center_index + 1] = count;
+  });
+  for (int c = 0; c < unknowns; c++)
+    outer[c + 1] += outer[c];
+  A.resizeNonZeros(outer[unknowns]);
+
+  int *inner = A.innerIndexPtr();
+  std::fill_n(A.valuePtr(), outer[unknowns], 0.0);
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j < cells.sy; j++) {
+    for (int i = 0; i < cells.sx; i++) {
+      int center_index = cells.unchecked(i, j);
+      if (center_index < 0)
+        continue;
+      int k = outer[center_index];
+      for (ivec2 offset : offsets) {
+        int index = neighbor_index(ivec2(i, j) + offset);
+        if (index >= 0)
+          inner[k++] = index;
       }
     }
-    coefficients.push_back(
-        Eigen::Triplet<double>(center_index, center_index, center_coefficient));
+  }
+}
+
+/** Builds everything about the pressure system that only depends on the
+ * solids: the index of each unknown, and depending on the backend either the
+ * sparsity pattern of the poisson matrix along with where each coefficient is
+ * stored and the symbolic analysis of the preconditioners, or the multigrid
+ * hierarchy. The matrix-free backend needs neither. This has to be called
+ * again if solid_phi or the backend changes, and with a free surface whenever
+ * the cells of the free surface fluid change. */
+void Simulation::initialize_pressure_system() {
+  get_fluid_ids();
+  count_fluid_cells(fluid_cell_count);
+  nf = fluid_cell_count.max() + 1;
+  /* every substep overwrites all of them, so a rebuild, which with a free
+   * surface can happen every substep, keeps the arrays */
+  if (u_coefficients.sx != sx + 1 || u_coefficients.sy != sy) {
+    u_coefficients.init(sx + 1, sy, 0.0, -0.5, h);
+    v_coefficients.init(sx, sy + 1, -0.5, 0.0, h);
+  }
+
+  if (!solver_settings.closed()) {
+    if (!supports_free_surface(solver_settings.type)) {
+      printf("~~ %s can't hold a free surface, falling back to mgpcg\n",
+             pressure_solver_name(solver_settings.type).c_str());
+      solver_settings.type = PressureSolverType::MGPCG;
+    }
+    /* the free surface fixes the pressure, there is no null space left */
+    solver_settings.null_space = NullSpace::NONE;
   }
 
-  Eigen::SparseMatrix<double> A(nf, nf);
-  A.setFromTriplets(coefficients.begin(), coefficients.end());
-  return A;
+  if (solver_settings.type == PressureSolverType::FFT &&
+      !fast_poisson.build(solid_phi)) {
+    printf("~~ fft needs the fluid cells to fill a rectangle, falling back to "
+           "mgpcg\n");
+    solver_settings.type = PressureSolverType::MGPCG;
+  }
+
+  if (!uses_assembled_matrix(solver_settings.type)) {
+    if (uses_multigrid(solver_settings.type)) {
+      auto surface = int_scratch.acquire(sx, sy, -0.5, -0.5, h);
+      for (int i = 0; i < surface->size(); i++)
+        (*surface)(i) = (fluid_id(i) == solver_settings.free_surface) ? 1 : 0;
+      multigrid.build_hierarchy(solid_phi, &*surface);
+      multigrid.project_null_space = solver_settings.closed();
+    }
+    return;
+  }
+
+  /* the assembly gives the pattern, after which the value of every
+   * coefficient is found in place */
+  assemble_poisson_pattern(fluid_cell_count, nf, poisson_matrix);
+
+  /* parallel_cg works on a row-major copy, where each thread owns its rows */
+  if (solver_settings.type == PressureSolverType::PARALLEL_CG) {
+    poisson_matrix_rows = poisson_matrix;
+    poisson_matrix_rows.makeCompressed();
+    poisson_matrix = Eigen::SparseMatrix<double>();
+    find_poisson_entries(poisson_matrix_rows);
+    std::vector<int> colors(nf);
+    fluid_cell_count.for_each_ij([&](int i, int j) {
+      if (fluid_cell_count.unchecked(i, j) >= 0)
+        colors[fluid_cell_count.unchecked(i, j)] = (i + j) % 2;
+    });
+    parallel_cg.set_colors(colors);
+    parallel_cg.threads = solver_settings.threads;
+    parallel_cg.project_null_space =
+        (solver_settings.null_space == NullSpace::PROJECT);
+    return;
+  }
+  find_poisson_entries(poisson_matrix);
+
+  /* mixed_cg only keeps a single precision copy, which has the same layout */
+  if (solver_settings.type == PressureSolverType::MIXED_CG) {
+    poisson_matrix_f = poisson_matrix.cast<float>();
+    poisson_matrix = Eigen::SparseMatrix<double>();
+    float_cg_solver.analyzePattern(poisson_matrix_f);
+    return;
+  }
+
+  /* the elimination order and the pattern of the factor never change, only
+   * the numerical factorization is redone when the coefficients do */
+  if (solver_settings.type == PressureSolverType::LDLT) {
+    ldlt_solver.analyzePattern(poisson_matrix);
+    return;
+  }
+
+  bool project = (solver_settings.null_space == NullSpace::PROJECT);
+  cg_solver.preconditioner().project = project;
+  cg_solver.analyzePattern(poisson_matrix);
+  mic_solver.preconditioner().project = project;
+  mic_solver.preconditioner().tau = solver_settings.mic_tau;
+  mic_solver.preconditioner().sigma = solver_settings.mic_sigma;
+  mic_solver.analyzePattern(poisson_matrix);
+}
+
+/** Fills poisson_entries with the positions in the values of matrix of the
+ * coefficients of every row, so that they can be rewritten in place */
+template <typename Matrix>
+void Simulation::find_poisson_entries(Matrix const &matrix) {
+  poisson_entries.assign(5 * nf, -1);
+  int const *outer = matrix.outerIndexPtr();
+  int const *inner = matrix.innerIndexPtr();
+  fluid_cell_count.for_each_ij([&](int i, int j) {
+    int center_index = fluid_cell_count.unchecked(i, j);
+    if (center_index < 0)
+      return;
+    int neighbors[5] = {center_index, -1, -1, -1, -1};
+    int n = 1;
+    for (auto offset : {ivec2(1, 0), ivec2(-1, 0), ivec2(0, 1), ivec2(0, -1)}) {
+      ivec2 kl = ivec2(i, j) + offset;
+      if (kl.x >= 0 && kl.y >= 0 && kl.x < sx && kl.y < sy)
+        neighbors[n] = fluid_cell_count.unchecked(kl.x, kl.y);
+      n++;
+    }
+    /* a row-major matrix stores row center_index contiguously, a column-major
+     * one stores it across the columns of its neighbors */
+    for (n = 0; n < 5; n++) {
+      if (neighbors[n] < 0)
+        continue;
+      int major = Matrix::IsRowMajor ? center_index : neighbors[n];
+      int minor = Matrix::IsRowMajor ? neighbors[n] : center_index;
+      for (int k = outer[major]; k < outer[major + 1]; k++) {
+        if (inner[k] == minor)
+          poisson_entries[5 * center_index + n] = k;
+      }
+    }
+  });
+}
+
+/** Writes the face coefficients of this substep into a cached poisson
+ * matrix */
+template <typename Matrix>
+void Simulation::update_poisson_coefficients(Matrix &matrix) {
+  typename Matrix::Scalar *values = matrix.valuePtr();
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j < sy; j++) {
+    for (int i = 0; i < sx; i++) {
+      int center_index = fluid_cell_count.unchecked(i, j);
+      if (center_index < 0)
+        continue;
+      int *entries = &poisson_entries[5 * center_index];
+      /* the +x, -x, +y and -y faces of the cell */
+      double faces[5] = {0, u_coefficients.unchecked(i + 1, j),
+                         u_coefficients.unchecked(i, j),
+                         v_coefficients.unchecked(i, j + 1),
+                         v_coefficients.unchecked(i, j)};
+      /* Every row sums to exactly 0 in the closed box, whose null space, the
+       * constant, is then removed by projecting or pinning (see
+       * solve_pressure). Faces to solids are 0, while faces to the free
+       * surface only add to the diagonal. */
+      double center_coefficient = 0;
+      for (int n = 1; n < 5; n++) {
+        if (entries[n] >= 0)
+          values[entries[n]] = faces[n];
+        center_coefficient -= faces[n];
+      }
+      values[entries[0]] = center_coefficient;
+    }
+  }
+}
+
+/** Turns the pressure of unknown 0 into a Dirichlet condition p = 0, which
+ * removes the null space of the closed box. The couplings between it and its
+ * neighbors are dropped from both its row and its column, so the matrix stays
+ * symmetric, while all diagonals are kept. The caller zeroes its right hand
+ * side. */
+template <typename Matrix>
+void Simulation::pin_reference_cell(Matrix &matrix) {
+  typename Matrix::Scalar *values = matrix.valuePtr();
+  ivec2 ij(0);
+  fluid_cell_count.for_each_ij([&](int i, int j) {
+    if (fluid_cell_count.unchecked(i, j) == 0)
+      ij = ivec2(i, j);
+  });
+  int n = 1;
+  int const opposite[5] = {0, 2, 1, 4, 3};
+  for (auto offset : {ivec2(1, 0), ivec2(-1, 0), ivec2(0, 1), ivec2(0, -1)}) {
+    int entry = poisson_entries[n];
+    if (entry >= 0) {
+      ivec2 kl = ij + offset;
+      int neighbor = fluid_cell_count.unchecked(kl.x, kl.y);
+      values[entry] = 0;
+      values[poisson_entries[5 * neighbor + opposite[n]]] = 0;
+    }
+    n++;
+  }
 }
 
 /** Sets up a linear system Ax=b to solve the discrete poission equation with
  * varying coefficients.
  */
 void Simulation::solve_pressure(float dt) {
-  /* Count each fluid cell, and find which voxels contain which fluids */
+  auto setup_start = std::chrono::high_resolution_clock::now();
+  /* Find which voxels contain which fluids */
   get_fluid_ids();
-  Array2i fluid_cell_count = count_fluid_cells();
-  int nf = fluid_cell_count.max() + 1; // number of fluid cells
-
-  /* Compute the discrete divergence of each fluid cell */
-  Eigen::VectorXd rhs(nf);
-  for (int i = 0; i < solid_phi.size(); i++) {
-    if (solid_phi(i) <= 0)
-      continue;
-    vec2 ij = solid_phi.ij_from_index(i);
-    rhs(fluid_cell_count(i)) = (1.f / (h * dt)) * (u(ij + vec2(1, 0)) - u(ij) +
-                                                   v(ij + vec2(0, 1)) - v(ij));
+  bool cells_changed = false;
+  if (nf != 0 && !solver_settings.closed()) {
+    auto cells = int_scratch.acquire(fluid_cell_count);
+    count_fluid_cells(*cells);
+    cells_changed = (cells->data != fluid_cell_count.data);
+  }
+  if (nf == 0 || cells_changed)
+    initialize_pressure_system();
+  if (solver_settings.save_snapshots && solver_stats.solves == 0)
+    save_pressure_snapshot(*this, dt,
+                           "plot/data/snapshot_" +
+                               std::to_string(frame_number) + ".json");
+
+  /* The backends and apply_pressure_gradient all read these face
+   * coefficients, so sample_density runs once per face and substep */
+  compute_face_coefficients(u_coefficients, v_coefficients);
+
+  /* Compute the discrete divergence of each fluid cell. The vectors are
+   * members, which only reallocate when the number of unknowns changes */
+  Eigen::VectorXd &rhs = pressure_rhs;
+  Eigen::VectorXd &pressures = pressure_solution;
+  rhs.resize(nf);
+  pressures.resize(nf);
+  fluid_cell_count.for_each_ij([&](int i, int j) {
+    int index = fluid_cell_count.unchecked(i, j);
+    if (index < 0)
+      return;
+    rhs(index) = (1.f / (h * dt)) * (u.unchecked(i + 1, j) - u.unchecked(i, j) +
+                                     v.unchecked(i, j + 1) - v.unchecked(i, j));
+  });
+
+  /* Start from zero or from the recent pressures, depending on warm_start */
+  pressure_guess(dt, pressures);
+
+  /* The closed box determines the pressure only up to a constant. Projecting
+   * makes the right hand side consistent and starts from a guess without a
+   * constant part, pinning fixes the pressure of unknown 0 (see
+   * pin_reference_cell). A factorization needs a nonsingular matrix, so ldlt
+   * always pins a closed box. */
+  bool pin = (solver_settings.null_space == NullSpace::PIN &&
+              uses_assembled_matrix(solver_settings.type)) ||
+             (solver_settings.type == PressureSolverType::LDLT &&
+              solver_settings.closed());
+  if (solver_settings.null_space == NullSpace::PROJECT) {
+    rhs.array() -= rhs.mean();
+    pressures.array() -= pressures.mean();
+  }
+  if (pin) {
+    rhs(0) = 0;
+    pressures(0) = 0;
+  }
+
+  /* An exactly singular system can't be solved to machine precision, the
+   * roundoff of the projections leaves a residual a few orders above it */
+  substep_tolerance = adaptive_tolerance(solver_settings.volume_error, dt,
+                                         rhs.norm(), nf);
+  double tolerance = solver_tolerance(
+      (solver_settings.null_space == NullSpace::PROJECT)
+          ? 1e-10
+          : Eigen::NumTraits<double>::epsilon());
+  int limit = solver_settings.iteration_limit(2 * nf);
+
+  auto solve_start = std::chrono::high_resolution_clock::now();
+  if (!uses_assembled_matrix(solver_settings.type)) {
+    solve_pressure_on_grid(rhs, pressures);
+  } else if (solver_settings.type == PressureSolverType::PARALLEL_CG) {
+    update_poisson_coefficients(poisson_matrix_rows);
+    if (pin)
+      pin_reference_cell(poisson_matrix_rows);
+    parallel_cg.solve(poisson_matrix_rows, rhs, pressures, tolerance, limit);
+    finish_solve(parallel_cg.iterations, limit, parallel_cg.error, tolerance);
+  } else if (solver_settings.type == PressureSolverType::LDLT) {
+    update_poisson_coefficients(poisson_matrix);
+    if (pin)
+      pin_reference_cell(poisson_matrix);
+    solve_pressure_direct(rhs, pressures);
+  } else if (solver_settings.type == PressureSolverType::MIXED_CG) {
+    update_poisson_coefficients(poisson_matrix_f);
+    if (pin)
+      pin_reference_cell(poisson_matrix_f);
+    solve_pressure_mixed(rhs, pressures);
+  } else {
+    /* Refresh the coefficient matrix */
+    update_poisson_coefficients(poisson_matrix);
+    if (pin)
+      pin_reference_cell(poisson_matrix);
+
+    /* Solve the linear system with the PCG method, reusing the symbolic
+     * analysis done in initialize_pressure_system */
+    if (solver_settings.type == PressureSolverType::MIC_CG) {
+      mic_solver.setTolerance(tolerance);
+      mic_solver.setMaxIterations(limit);
+      mic_solver.factorize(poisson_matrix);
+      pressures = mic_solver.solveWithGuess(rhs, pressures);
+      finish_solve(mic_solver.iterations(), limit, mic_solver.error(),
+                   tolerance);
+    } else {
+      cg_solver.setTolerance(tolerance);
+      cg_solver.setMaxIterations(limit);
+      cg_solver.factorize(poisson_matrix);
+      pressures = cg_solver.solveWithGuess(rhs, pressures);
+      finish_solve(cg_solver.iterations(), limit, cg_solver.error(),
+                   tolerance);
+    }
   }
+  auto solve_end = std::chrono::high_resolution_clock::now();
 
-  /* Assemble the coefficient matrix */
-  Eigen::SparseMatrix<double> A =
-      assemble_poisson_coefficient_matrix(fluid_cell_count, nf);
-
-  /* Copy old pressure to a vector, to use as a guess */
-  // Eigen::VectorXd old_pressures(nf);
-  // for (int i = 0; i < p.size(); i++) {
-  //   if (fluid_cell_count(i) < 0)
-  //     continue;
-  //   old_pressures(fluid_cell_count(i)) = p(i);
-  // }
-
-  /* Solve the linear system with the PCG method */
-  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>> solver;
-  Eigen::VectorXd pressures(nf);
-  solver.compute(A);
-  // pressures = solver.solveWithGuess(rhs, old_pressures);
-  pressures = solver.solve(rhs);
+  /* report the solve, finish_solve filled in what the backend did */
+  last_solve.frame = frame_number;
+  last_solve.substep = solver_stats.solves;
+  last_solve.dt = dt;
+  last_solve.type = solver_settings.type;
+  last_solve.unknowns = nf;
+  last_solve.setup_seconds =
+      std::chrono::duration<double>(solve_start - setup_start).count();
+  last_solve.solve_seconds =
+      std::chrono::duration<double>(solve_end - solve_start).count();
+  solver_stats.record(last_solve);
+  solver_stats.record_mean(pressures.mean());
+  if (on_pressure_solve)
+    on_pressure_solve(last_solve);
+
+  /* Keep the previous pressure around for extrapolation. p is rewritten
+   * below, so it can take old_p's storage instead of being copied */
+  if (solver_settings.warm_start == WarmStart::EXTRAPOLATE) {
+    if (old_p.sx == p.sx && old_p.sy == p.sy)
+      std::swap(old_p.data, p.data);
+    else
+      old_p = p;
+  }
+  last_pressure_dt = dt;
+  pressure_history = std::min(pressure_history + 1, 2);
 
   /* Copy the new pressure values over */
   p.clear();
-  for (int i = 0; i < p.size(); i++) {
-    if (fluid_cell_count(i) < 0)
-      continue;
-    p(i) = pressures(fluid_cell_count(i));
+  fluid_cell_count.for_each_ij([&](int i, int j) {
+    int index = fluid_cell_count.unchecked(i, j);
+    if (index >= 0)
+      p.unchecked(i, j) = pressures(index);
+  });
+}
+
+/** Solves the pressure system by iterative refinement: the residual and the
+ * solution are kept in double precision, while each correction comes from a
+ * conjugate gradient solve in single precision on poisson_matrix_f. The inner
+ * solves only need to gain a few digits each, and their products stream half
+ * the bytes of the double precision system. */
+void Simulation::solve_pressure_mixed(Eigen::VectorXd &rhs,
+                                      Eigen::VectorXd &pressures) {
+  float_cg_solver.setTolerance(solver_settings.mixed_inner_tolerance);
+  float_cg_solver.factorize(poisson_matrix_f);
+  double tolerance = solver_tolerance(solver_settings.mixed_tolerance);
+  double rhs_norm = rhs.norm();
+  int iterations = 0;
+  double error = 0;
+  int limit =
+      solver_settings.iteration_limit(solver_settings.mixed_max_refinements);
+  int refinements = 0;
+  Eigen::VectorXd &residual = mixed_residual;
+  Eigen::VectorXf &correction = mixed_correction;
+  for (; refinements <= limit; refinements++) {
+    residual = rhs;
+    residual.noalias() -= poisson_matrix_f.cast<double>() * pressures;
+    /* the closed box leaves the constant pressure undetermined, and a single
+     * precision solve cannot resolve a residual with a constant part. A
+     * pinned system has no such part. */
+    if (solver_settings.closed() &&
+        solver_settings.null_space != NullSpace::PIN)
+      residual.array() -= residual.mean();
+    error = (rhs_norm > 0) ? residual.norm() / rhs_norm : 0;
+    if (error < tolerance || refinements == limit)
+      break;
+    mixed_residual_f = residual.cast<float>();
+    correction = float_cg_solver.solve(mixed_residual_f);
+    iterations += float_cg_solver.iterations();
+    pressures += correction.cast<double>();
+    if (solver_settings.null_space == NullSpace::PROJECT)
+      pressures.array() -= pressures.mean();
+  }
+  /* the limit is on the refinements, the iterations are the inner ones */
+  finish_solve(refinements, limit, error, tolerance);
+  last_solve.iterations = iterations;
+}
+
+/** Solves the pinned pressure system with the sparse LDLT factorization,
+ * which is only redone when a coefficient changed (see CachedLDLT). If the
+ * factorization fails, this substep and every later one are solved with cg
+ * instead, this one from the guess in pressures. */
+void Simulation::solve_pressure_direct(Eigen::VectorXd &rhs,
+                                       Eigen::VectorXd &pressures) {
+  if (ldlt_solver.factorize(poisson_matrix)) {
+    pressures = ldlt_solver.solve(rhs);
+    double rhs_norm = rhs.norm();
+    double error = (rhs_norm > 0)
+                       ? (rhs - poisson_matrix * pressures).norm() / rhs_norm
+                       : 0;
+    finish_solve(0, 0, error, INFINITY);
+  } else {
+    printf("~~ the ldlt factorization of the pressure system failed, falling "
+           "back to cg\n");
+    solver_settings.type = PressureSolverType::CG;
+    double tolerance = solver_tolerance(Eigen::NumTraits<double>::epsilon());
+    int limit = solver_settings.iteration_limit(2 * nf);
+    /* this matrix is pinned, from the next substep on cg handles the null
+     * space as configured */
+    cg_solver.preconditioner().project = false;
+    cg_solver.analyzePattern(poisson_matrix);
+    cg_solver.setTolerance(tolerance);
+    cg_solver.setMaxIterations(limit);
+    cg_solver.factorize(poisson_matrix);
+    pressures = cg_solver.solveWithGuess(rhs, pressures);
+    finish_solve(cg_solver.iterations(), limit, cg_solver.error(), tolerance);
+    cg_solver.preconditioner().project =
+        (solver_settings.null_space == NullSpace::PROJECT);
+  }
+  /* only the pressure differences are determined, so the pinned solution is
+   * as good as the projected one, which just has to be shifted */
+  if (solver_settings.null_space == NullSpace::PROJECT)
+    pressures.array() -= pressures.mean();
+}
+
+/** Fills in the outcome of the backend in last_solve. A solve reached its cap
+ * if it used all of its limit and still missed its tolerance. */
+void Simulation::finish_solve(int iterations, int limit, double error,
+                              double tolerance) {
+  last_solve.iterations = iterations;
+  last_solve.max_iterations = limit;
+  last_solve.error = error;
+  last_solve.tolerance = tolerance;
+  last_solve.reached_cap = (iterations >= limit && error >= tolerance);
+}
+
+/** The tolerance a backend stops at this substep: the adaptive one if asked
+ * for, else the configured one or the backend's own */
+double Simulation::solver_tolerance(double backend_tolerance) {
+  if (solver_settings.adaptive_tolerance)
+    return substep_tolerance;
+  return solver_settings.tolerance_for(backend_tolerance);
+}
+
+/** Fills the initial guess of a pressure solve for a substep of length dt.
+ * WarmStart::PREVIOUS reuses the last pressure, WarmStart::EXTRAPOLATE
+ * extends the line through the last two pressures to the end of this substep:
+ *   p_guess = p_n + (p_n - p_{n-1}) * dt / dt_n
+ * where dt_n is the length of the substep that produced p_n, so that unequal
+ * CFL substeps are extrapolated consistently in time. */
+void Simulation::pressure_guess(float dt, Eigen::VectorXd &guess) {
+  guess.setZero();
+  WarmStart mode = solver_settings.warm_start;
+  if (mode == WarmStart::NONE || pressure_history == 0)
+    return;
+  bool extrapolate = (mode == WarmStart::EXTRAPOLATE && pressure_history > 1);
+  float slope = extrapolate ? dt / last_pressure_dt : 0.f;
+  fluid_cell_count.for_each_ij([&](int i, int j) {
+    int index = fluid_cell_count.unchecked(i, j);
+    if (index < 0)
+      return;
+    float current = p.unchecked(i, j);
+    float previous = extrapolate ? old_p.unchecked(i, j) : current;
+    guess(index) = current + slope * (current - previous);
+  });
+}
+
+/** Solves the pressure system with one of the backends that work on the cell
+ * grid instead of an assembled matrix: geometric multigrid, either on its own
+ * or as the preconditioner of CG, or the matrix-free CG. The multigrid
+ * hierarchy is built once in initialize_pressure_system and only its
+ * coefficients are refreshed here. pressures holds the initial guess on
+ * entry. */
+void Simulation::solve_pressure_on_grid(Eigen::VectorXd &rhs,
+                                        Eigen::VectorXd &pressures) {
+  if (uses_multigrid(solver_settings.type))
+    multigrid.update_coefficients(u_coefficients, v_coefficients);
+
+  auto scratch_b = double_scratch.acquire(sx, sy, -0.5, -0.5, h);
+  auto scratch_x = double_scratch.acquire(sx, sy, -0.5, -0.5, h);
+  Array2d &b = *scratch_b;
+  Array2d &x = *scratch_x;
+  b.clear();
+  x.clear();
+  fluid_cell_count.for_each_ij([&](int i, int j) {
+    int index = fluid_cell_count.unchecked(i, j);
+    if (index < 0)
+      return;
+    b.unchecked(i, j) = rhs(index);
+    x.unchecked(i, j) = pressures(index);
+  });
+  if (solver_settings.type == PressureSolverType::MATRIX_FREE_CG) {
+    /* the same stopping criterion as Eigen's ConjugateGradient */
+    double tolerance = solver_tolerance(Eigen::NumTraits<double>::epsilon());
+    int limit = solver_settings.iteration_limit(2 * nf);
+    matrix_free.solve(b, x, tolerance, limit);
+    finish_solve(matrix_free.iterations, limit, matrix_free.error, tolerance);
+  } else if (solver_settings.type == PressureSolverType::FFT) {
+    double tolerance = solver_tolerance(solver_settings.fft_tolerance);
+    int limit =
+        solver_settings.iteration_limit(solver_settings.fft_max_iterations);
+    fast_poisson.solve(u_coefficients, v_coefficients, b, x, tolerance, limit);
+    finish_solve(fast_poisson.iterations, limit, fast_poisson.error,
+                 tolerance);
+  } else if (solver_settings.type == PressureSolverType::SOR) {
+    sor.omega = solver_settings.sor_omega;
+    sor.chebyshev = solver_settings.sor_chebyshev;
+    sor.threads = solver_settings.threads;
+    int sweeps = solver_settings.iteration_limit(solver_settings.sor_sweeps);
+    sor.solve(solid_phi, u_coefficients, v_coefficients, b, x, sweeps);
+    /* a fixed budget of sweeps, so there is no tolerance to miss */
+    finish_solve(sor.iterations, sweeps, sor.error, INFINITY);
+  } else {
+    double tolerance = solver_tolerance(solver_settings.multigrid_tolerance);
+    int limit =
+        solver_settings.iteration_limit(solver_settings.multigrid_max_cycles);
+    if (solver_settings.type == PressureSolverType::MGPCG)
+      multigrid.solve_preconditioned_cg(b, x, tolerance, limit);
+    else
+      multigrid.solve(b, x, tolerance, limit);
+    finish_solve(multigrid.iterations, limit, multigrid.error, tolerance);
   }
+  fluid_cell_count.for_each_ij([&](int i, int j) {
+    int index = fluid_cell_count.unchecked(i, j);
+    if (index >= 0)
+      pressures(index) = x.unchecked(i, j);
+  });
 }
 
-/** Applies the discrete pressure gradient using a similar method as how the
- * coefficient matrix in solve_pressure is constructed. */
+/** Extends the velocities of the faces that were projected (those with a
+ * coefficient) into the free surface fluid, a layer of faces at a time, each
+ * new face taking the mean of its already known neighbors. Faces further away
+ * are zeroed, as nothing drives the velocity of the free surface fluid and
+ * gravity alone would let it grow without bound. */
+void Simulation::extrapolate_velocity() {
+  int const layers = 5;
+  auto extrapolate = [&](AlignedArray2f &velocity, Array2d &coefficients,
+                         ivec2 normal) {
+    /* 1 if known, 0 if to be filled, -1 if the face touches a solid */
+    auto scratch_known = int_scratch.acquire(velocity.sx, velocity.sy, 0, 0, h);
+    Array2i &known = *scratch_known;
+    for (int j = 0; j < velocity.sy; j++) {
+      for (int i = 0; i < velocity.sx; i++) {
+        ivec2 a = ivec2(i, j) - normal;
+        ivec2 b(i, j);
+        if (a.x < 0 || a.y < 0 || b.x >= sx || b.y >= sy ||
+            solid_phi(a.x, a.y) <= 0 || solid_phi(b.x, b.y) <= 0)
+          known(i, j) = -1;
+        else
+          known(i, j) = (coefficients(i, j) != 0) ? 1 : 0;
+      }
+    }
+    auto &layer = extrapolation_layer;
+    for (int n = 0; n < layers; n++) {
+      layer.clear();
+      for (int j = 0; j < velocity.sy; j++) {
+        for (int i = 0; i < velocity.sx; i++) {
+          if (known(i, j) != 0)
+            continue;
+          float sum = 0;
+          int count = 0;
+          for (ivec2 kl : {ivec2(i - 1, j), ivec2(i + 1, j), ivec2(i, j - 1),
+                           ivec2(i, j + 1)}) {
+            if (kl.x < 0 || kl.y < 0 || kl.x >= velocity.sx ||
+                kl.y >= velocity.sy || known(kl.x, kl.y) != 1)
+              continue;
+            sum += velocity.unchecked(kl.x, kl.y);
+            count++;
+          }
+          if (count > 0)
+            layer.emplace_back(ivec2(i, j), sum / count);
+        }
+      }
+      for (auto &[ij, value] : layer) {
+        velocity.unchecked(ij.x, ij.y) = value;
+        known.unchecked(ij.x, ij.y) = 1;
+      }
+    }
+    velocity.for_each_ij([&](int i, int j) {
+      if (known.unchecked(i, j) == 0)
+        velocity.unchecked(i, j) = 0;
+    });
+  };
+  extrapolate(u, u_coefficients, ivec2(1, 0));
+  extrapolate(v, v_coefficients, ivec2(0, 1));
+}
+
+/** Applies the discrete pressure gradient with the face coefficients that
+ * solve_pressure computed for this substep, so it is consistent with the
+ * poisson equation that was solved. */
 void Simulation::apply_pressure_gradient(float dt) {
-  for (auto it = u.begin(); it != u.end(); it++) {
-    vec2 ij = it.ij();
-    if (ij.x < 1 || ij.x >= u.sx - 1)
-      continue;
-    if (solid_phi(ij) <= 0 || solid_phi(ij - vec2(1, 0)) <= 0)
-      continue;
-    float du = sample_density(ij, ij - vec2(1, 0)) * (dt / h) *
-               (p(ij) - p(ij - vec2(1, 0)));
-    u(ij) -= du;
+  /* the face coefficients are b / h^2, the gradient needs b * dt / h */
+  float scale = dt * h;
+  /* Only interior faces are visited, both of their cells are in range. A
+   * face without a coefficient contributes 0, so every face of a row is
+   * updated without branches. */
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j < u.sy; j++) {
+    float *u_row = u.row(j);
+    double *coefficients = u_coefficients.row(j);
+    float *p_row = p.row(j);
+    for (int i = 1; i < u.sx - 1; i++)
+      u_row[i] -= coefficients[i] * scale * (p_row[i] - p_row[i - 1]);
   }
 
-  for (auto it = v.begin(); it != v.end(); it++) {
-    vec2 ij = it.ij();
-    if (ij.y < 1 || ij.y >= v.sy - 1)
-      continue;
-    if (solid_phi(ij) <= 0 || solid_phi(ij - vec2(0, 1)) <= 0)
-      continue;
-    float dv = sample_density(ij, ij - vec2(0, 1)) * (dt / h) *
-               (p(ij) - p(ij - vec2(0, 1)));
-    v(ij) -= dv;
+#pragma omp parallel for schedule(static)
+  for (int j = 1; j < v.sy - 1; j++) {
+    float *v_row = v.row(j);
+    double *coefficients = v_coefficients.row(j);
+    float *p_row = p.row(j);
+    float *p_below = p.row(j - 1);
+    for (int i = 0; i < v.sx; i++)
+      v_row[i] -= coefficients[i] * scale * (p_row[i] - p_below[i]);
   }
 }
+
+/* the instantiation the tests compare against a reference assembly */
+template void
+Simulation::update_poisson_coefficients(Eigen::SparseMatrix<double> &matrix);
@@ -1,9 +1,22 @@
 #pragma once
+#include "cached_ldlt.hpp"
+#include "fast_poisson.hpp"
 #include "fluid.hpp"
+#include "matrix_free.hpp"
+#include "mic_preconditioner.hpp"
+#include "multigrid.hpp"
+#include "null_space.hpp"
+#include "parallel_cg.hpp"
+#include "pressure_solver.hpp"
+#include "relaxation.hpp"
+#include "scratch_pool.hpp"
 #include "velocityfield.hpp"
 #include <chrono>
+#include <eigen3/Eigen/IterativeLinearSolvers>
 #include <eigen3/Eigen/SparseCore>
+#include <functional>
 #include <stdio.h>
+#include <string>
 #include <vector>
 
 /** \class Simulation
@@ -30,10 +43,22 @@ public:
 
   vec4 rxn; // 0 -> reactant1, 1->reactant2, 2->product, 3->rate
 
-  Array2f u; // horizontal velocity, sampled at cell sides
-  Array2f v; // vertical velocity, sampled at cell tops/bottoms
-  Array2f p; // pressure, sampled at center
+  AlignedArray2f u; // horizontal velocity, sampled at cell sides
+  AlignedArray2f v; // vertical velocity, sampled at cell tops/bottoms
+  AlignedArray2f p; // pressure, sampled at center
+  AlignedArray2f old_p; // pressure of the substep before p, used for warm
+                        // starts
+  float last_pressure_dt = 0; // length of the substep that produced p
+  int pressure_history = 0;   // how many of p and old_p hold solves
   VelocityField vel;
+  PaddedArray2f padded_u, padded_v; // u and v with ghost cells, for advection
+
+  /* the full-grid temporaries of a substep, reused between substeps */
+  ScratchPool<float> float_scratch;
+  ScratchPool<float, AlignedRows<>> face_scratch; // shaped like u and v
+  ScratchPool<int> int_scratch;
+  ScratchPool<double> double_scratch;
+  SampleBatch sample_batch; // positions and samples of batched lookups
 
   std::vector<Fluid> fluids;
   Array2f solid_phi; // phi corresponding to solid boundaries, not important as
@@ -41,6 +66,56 @@ public:
   Array2i fluid_id;  // describes which fluid occupies a given voxel, sampled at
                      // cell centers.
 
+  PressureSolverSettings solver_settings; // which backend solves for pressure
+  SolverStats solver_stats; // convergence information of the current frame
+  SolveMetrics last_solve;  // what the last pressure solve did
+  double substep_tolerance = 0; // tolerance of the current substep when it
+                                // is adaptive
+  std::function<void(SolveMetrics const &)>
+      on_pressure_solve; // called after every pressure solve, if set
+  MultigridSolver multigrid; // kept between solves to reuse its levels
+  MatrixFreePoisson matrix_free; // computes A*x from the face coefficients
+  RedBlackSOR sor;               // the relaxation solver of "sor"
+  FastPoissonSolver fast_poisson; // the transform solver of "fft"
+
+  /* The layout of the pressure system only depends on solid_phi, so it is
+   * built once by initialize_pressure_system and only the coefficients are
+   * refreshed every substep */
+  int nf = 0;               // number of unknowns of the pressure system
+  Array2i fluid_cell_count; // index of each non-solid cell, -1 for solids
+  Eigen::SparseMatrix<double> poisson_matrix;
+  Eigen::SparseMatrix<float> poisson_matrix_f; // replaces poisson_matrix for
+                                               // mixed_cg
+  ParallelConjugateGradient::Matrix poisson_matrix_rows; // replaces
+                                                         // poisson_matrix for
+                                                         // parallel_cg
+  std::vector<int> poisson_entries; // per unknown, the position in
+                                    // poisson_matrix's values of the
+                                    // center, +x, -x, +y, -y coefficients
+  Array2d u_coefficients; // poisson coefficients of the u-faces
+  Array2d v_coefficients; // poisson coefficients of the v-faces
+  /* the vectors of a solve, kept so that substeps do not allocate them */
+  Eigen::VectorXd pressure_rhs;      // the divergence of every unknown
+  Eigen::VectorXd pressure_solution; // the guess, then the pressures
+  Eigen::VectorXd mixed_residual;    // mixed_cg: the double residual
+  Eigen::VectorXf mixed_residual_f;  // mixed_cg: it rounded to float
+  Eigen::VectorXf mixed_correction;  // mixed_cg: the inner solution
+  std::vector<std::pair<ivec2, float>>
+      extrapolation_layer; // the faces extrapolate_velocity fills next
+  Eigen::ConjugateGradient<
+      Eigen::SparseMatrix<double>, Eigen::Lower,
+      NullSpaceProjection<Eigen::DiagonalPreconditioner<double>>>
+      cg_solver;
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>,
+                           Eigen::Lower | Eigen::Upper,
+                           NullSpaceProjection<ModifiedIncompleteCholesky>>
+      mic_solver;
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<float>,
+                           Eigen::Lower | Eigen::Upper>
+      float_cg_solver;                   // the inner solver of mixed_cg
+  ParallelConjugateGradient parallel_cg; // the solver of parallel_cg
+  CachedLDLT ldlt_solver; // the factorization of ldlt
+
   Simulation() {}
   Simulation(int sx_, int sy_, float h_) : sx(sx_), sy(sy_), h(h_) {}
 
@@ -55,6 +130,8 @@ public:
     fluid_id.init(sx, sy, -0.5, -0.5, h);
     vel.up = &u;
     vel.vp = &v;
+    matrix_free =
+        MatrixFreePoisson(&solid_phi, &u_coefficients, &v_coefficients);
   }
 
   void init(int sx_, int sy_, float h_, float max_t_, float dt_) {
@@ -73,9 +150,10 @@ public:
     printf("~~ Simulation information ~~\n sx: %i, sy: %i, h: %f\n no. "
            "fluids: %i\n",
            sx, sy, h, static_cast<int>(fluids.size()));
-    for (auto f : fluids) {
+    for (auto &f : fluids) {
       f.print_information();
     }
+    solver_settings.print_information();
   }
 
   void run();
@@ -89,9 +167,23 @@ public:
   /* Methods specifically used for solving for pressure */
   void solve_pressure(float dt);
   void apply_pressure_gradient(float dt);
+  void extrapolate_velocity();
   float sample_density(vec2 ij, vec2 kl);
-  Eigen::SparseMatrix<double>
-  assemble_poisson_coefficient_matrix(Array2i fluid_cell_count, int nf);
-  Array2i count_fluid_cells();
+  void compute_face_coefficients(Array2d &u_coefficients,
+                                 Array2d &v_coefficients);
+  void pressure_guess(float dt, Eigen::VectorXd &guess);
+  void solve_pressure_on_grid(Eigen::VectorXd &rhs,
+                              Eigen::VectorXd &pressures);
+  void solve_pressure_mixed(Eigen::VectorXd &rhs, Eigen::VectorXd &pressures);
+  void solve_pressure_direct(Eigen::VectorXd &rhs, Eigen::VectorXd &pressures);
+  void finish_solve(int iterations, int limit, double error, double tolerance);
+  double solver_tolerance(double backend_tolerance);
+  void initialize_pressure_system();
+  template <typename Matrix> void find_poisson_entries(Matrix const &matrix);
+  template <typename Matrix> void update_poisson_coefficients(Matrix &matrix);
+  template <typename Matrix> void pin_reference_cell(Matrix &matrix);
+  void assemble_poisson_pattern(Array2i const &cells, int unknowns,
+                                Eigen::SparseMatrix<double> &A) const;
+  void count_fluid_cells(Array2i &cells);
   void get_fluid_ids();
 };
\ No newline at end of file
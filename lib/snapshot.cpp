@@ -0,0 +1,73 @@
+#include "snapshot.hpp"
+#include "json.hpp"
+#include "simulation.hpp"
+#include <fstream>
+
+using json = nlohmann::json;
+
+namespace {
+
+/** the cells of a in row-major order, without the padding of its layout */
+template <typename T, class Layout> json to_json(Array2<T, Layout> const &a) {
+  std::vector<T> data;
+  data.reserve(a.size());
+  a.for_each_ij([&](int i, int j) { data.push_back(a.unchecked(i, j)); });
+  return json{{"sx", a.sx}, {"sy", a.sy}, {"data", data}};
+}
+
+/** fills a, already initialized for the new resolution, by sampling the saved
+ * array, of cell size h, at the world position of each of its points */
+template <typename T, class Layout>
+void from_json(json const &j, float h, Array2<T, Layout> &a) {
+  Array2<T> saved(j["sx"].get<int>(), j["sy"].get<int>(), a.offset_x,
+                  a.offset_y, h);
+  auto values = j["data"].get<std::vector<T>>();
+  saved.data.assign(values.begin(), values.end());
+  a.for_each_ij([&](int i, int j) {
+    a.unchecked(i, j) = saved.value_at(a.worldspace_of(i, j));
+  });
+}
+
+} // namespace
+
+void save_pressure_snapshot(Simulation &sim, float dt,
+                            std::string const &path) {
+  json j;
+  j["sx"] = sim.sx;
+  j["sy"] = sim.sy;
+  j["h"] = sim.h;
+  j["dt"] = dt;
+  j["frame"] = sim.frame_number;
+  j["u"] = to_json(sim.u);
+  j["v"] = to_json(sim.v);
+  j["solid_phi"] = to_json(sim.solid_phi);
+  j["fluid_id"] = to_json(sim.fluid_id);
+  for (auto &f : sim.fluids)
+    j["fluids"].push_back({{"density", f.density}, {"phi", to_json(f.phi)}});
+  std::ofstream file(path);
+  file << j;
+}
+
+float load_pressure_snapshot(Simulation &sim, std::string const &path,
+                             int scale) {
+  std::ifstream file(path);
+  if (!file)
+    return 0;
+  json j;
+  file >> j;
+  float h = j["h"].get<float>();
+  sim.init(scale * j["sx"].get<int>(), scale * j["sy"].get<int>(), h / scale,
+           0, 0);
+  sim.frame_number = j["frame"].get<int>();
+  from_json(j["u"], h, sim.u);
+  from_json(j["v"], h, sim.v);
+  from_json(j["solid_phi"], h, sim.solid_phi);
+  for (auto &f : j["fluids"]) {
+    sim.add_fluid(f["density"].get<float>());
+    from_json(f["phi"], h, sim.fluids.back().phi);
+  }
+  /* fluid_id is only saved for inspection, interpolating ids would be
+   * meaningless, so it is found from the level sets again */
+  sim.get_fluid_ids();
+  return j["dt"].get<float>();
+}
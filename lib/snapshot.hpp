@@ -0,0 +1,21 @@
+#pragma once
+#include <string>
+
+class Simulation;
+
+/** \file snapshot.hpp
+ * Saves and restores everything a pressure solve starts from: the domain, the
+ * densities and level sets of the fluids, solid_phi, fluid_id, the velocities
+ * the divergence is taken of, and the length of the substep. This lets the
+ * pressure benchmark solve the systems of a real run without running it. */
+
+/** Writes the current state of sim as json, dt being the substep about to be
+ * solved for */
+void save_pressure_snapshot(Simulation &sim, float dt, std::string const &path);
+
+/** Sets up sim (which should be freshly constructed) from a snapshot, with
+ * scale times as many cells along each axis over the same domain. Every field
+ * is interpolated from the saved one, so any scale gives a consistent system.
+ * Returns the dt of the snapshot, or 0 if the file could not be read. */
+float load_pressure_snapshot(Simulation &sim, std::string const &path,
+                             int scale = 1);
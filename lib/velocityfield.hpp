@@ -1,13 +1,50 @@
 #pragma once
 #include "array2.hpp"
+#include "padded_array2.hpp"
 #include <glm/glm.hpp>
+#include <vector>
 
-struct VelocityField {
-  Array2f *up;
-  Array2f *vp;
-  VelocityField() {}
-  VelocityField(Array2f *u_, Array2f *v_) : up(u_), vp(v_) {}
-  vec2 operator()(glm::vec2 world_position) {
+/** Samples the staggered velocity stored in two grids of type Array, which can
+ * be any Array2 of floats or PaddedArray2f */
+template <class Array> struct BasicVelocityField {
+  Array *up;
+  Array *vp;
+  BasicVelocityField() {}
+  BasicVelocityField(Array *u_, Array *v_) : up(u_), vp(v_) {}
+  vec2 operator()(glm::vec2 world_position) const {
     return vec2(up->value_at(world_position), vp->value_at(world_position));
   }
-};
\ No newline at end of file
+};
+
+typedef BasicVelocityField<AlignedArray2f> VelocityField;
+typedef BasicVelocityField<PaddedArray2f> PaddedVelocityField;
+
+/** Reusable buffers for sampling grids at many points at once, see
+ * Array2::values_at and rk4_batch. Every coordinate has an array of its own,
+ * so that the batched loops load them with plain vector loads. */
+struct SampleBatch {
+  std::vector<float> x;          // the points to sample or trace
+  std::vector<float> y;
+  std::vector<float> values;     // one sample per point
+  std::vector<float> stage_x;    // rk4_batch: where the current stage samples
+  std::vector<float> stage_y;
+  std::vector<float> sum_x;      // rk4_batch: weighted sum of the stages
+  std::vector<float> sum_y;
+  std::vector<float> velocity_x; // rk4_batch: the velocity at the stage
+  std::vector<float> velocity_y;
+
+  /** resizes every buffer to n points, keeping their capacity. Growing them
+   * all together means that once a substep has seen the most points, no
+   * later one allocates. */
+  void resize(int n) {
+    for (auto *buffer : {&x, &y, &values, &stage_x, &stage_y, &sum_x, &sum_y,
+                         &velocity_x, &velocity_y})
+      buffer->resize(n);
+  }
+
+  vec2 position(int k) const { return vec2(x[k], y[k]); }
+  void set_position(int k, vec2 position) {
+    x[k] = position.x;
+    y[k] = position.y;
+  }
+};
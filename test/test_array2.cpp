@@ -0,0 +1,177 @@
+#include "gtest/gtest.h"
+
+#include "calculus.hpp"
+#include "scratch_pool.hpp"
+
+TEST(Array2, split_loop_visits_every_cell_once) {
+  Array2i visits(7, 5, -0.5, -0.5, 1.0);
+  visits.for_each_split([&](int i, int j) { visits.unchecked(i, j) += 1; },
+                        [&](int i, int j) { visits(i, j) += 10; });
+  for (int j = 0; j < 5; j++) {
+    for (int i = 0; i < 7; i++) {
+      bool border = (i == 0 || j == 0 || i == 6 || j == 4);
+      EXPECT_EQ(visits(i, j), border ? 10 : 1);
+    }
+  }
+}
+
+TEST(PaddedArray2, clamped_ghosts_match_array2_sampling) {
+  Array2f field(5, 4, -0.5, 0, 0.5);
+  for (int i = 0; i < field.size(); i++)
+    field(i) = std::cos(1.3f * i);
+  PaddedArray2f padded(field, 1, GhostPolicy::CLAMP);
+  for (float x = -1.3f; x < 4.f; x += 0.37f) {
+    for (float y = -1.1f; y < 3.f; y += 0.41f)
+      EXPECT_EQ(padded.value_at(vec2(x, y)), field.value_at(vec2(x, y)));
+  }
+}
+
+TEST(PaddedArray2, zero_and_periodic_ghosts) {
+  Array2f field(3, 2, 0, 0, 1.0);
+  for (int i = 0; i < field.size(); i++)
+    field(i) = i + 1;
+  PaddedArray2f zero(field, 2, GhostPolicy::ZERO);
+  PaddedArray2f periodic(field, 2, GhostPolicy::PERIODIC);
+  EXPECT_EQ(zero(-1, 0), 0);
+  EXPECT_EQ(zero(1, 3), 0);
+  EXPECT_EQ(zero(2, 1), field(2, 1));
+  EXPECT_EQ(periodic(-1, 0), field(2, 0));
+  EXPECT_EQ(periodic(4, -2), field(1, 0));
+  EXPECT_EQ(periodic(-2, 3), field(1, 1));
+}
+
+TEST(Array2, index_loop_matches_iterator) {
+  Array2f grid(4, 3, -0.5, 0, 0.25);
+  auto it = grid.begin();
+  grid.for_each_ij([&](int i, int j) {
+    EXPECT_EQ(vec2(i, j), it.ij());
+    EXPECT_EQ(grid.worldspace_of(i, j), it.wp());
+    it++;
+  });
+  EXPECT_TRUE(it == grid.end());
+}
+
+TEST(Array2, aligned_rows_start_on_cache_lines) {
+  Array2<float, AlignedRows<>> padded(21, 5, -0.5, -0.5, 1.0);
+  Array2f dense(21, 5, -0.5, -0.5, 1.0);
+  EXPECT_EQ(padded.pitch, 32);
+  EXPECT_EQ(dense.pitch, 21);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(dense.row(0)) % 64, 0u);
+  for (int j = 0; j < 5; j++)
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(padded.row(j)) % 64, 0u);
+  dense.for_each_ij([&](int i, int j) { dense(i, j) = i + 100 * j; });
+  padded.for_each_ij([&](int i, int j) { padded(i, j) = i + 100 * j; });
+  for (vec2 position : {vec2(3.3, 1.7), vec2(19.9, 3.2), vec2(-1, 7)})
+    EXPECT_EQ(padded.value_at(position), dense.value_at(position));
+}
+
+TEST(Array2, reductions_skip_the_padding) {
+  Array2<float, AlignedRows<>> padded(21, 5, -0.5, -0.5, 1.0);
+  padded.for_each_ij([&](int i, int j) { padded(i, j) = -5.f - i - j; });
+  EXPECT_EQ(padded.max(), -5.f);
+  EXPECT_EQ(padded.min(), -29.f);
+  EXPECT_EQ(padded.infnorm(), 29.f);
+  padded.clamp(-7.f, -6.f);
+  EXPECT_EQ(padded.max(), -6.f);
+  EXPECT_EQ(padded.min(), -7.f);
+}
+
+template <class Layout> void expect_layout_matches_dense() {
+  Array2f dense(13, 9, 0, -0.5, 0.5);
+  Array2<float, Layout> other(13, 9, 0, -0.5, 0.5);
+  std::vector<bool> used(other.data.size(), false);
+  dense.for_each_ij([&](int i, int j) {
+    int index = other.index_from_ij(vec2(i, j));
+    EXPECT_FALSE(used[index]);
+    used[index] = true;
+    dense(i, j) = std::sin(0.3f * i + j);
+    other(i, j) = dense(i, j);
+  });
+  for (float x = -0.2f; x < 7.f; x += 0.43f) {
+    for (float y = -0.3f; y < 5.f; y += 0.37f)
+      EXPECT_EQ(other.value_at(vec2(x, y)), dense.value_at(vec2(x, y)));
+  }
+}
+
+TEST(Array2, tiled_and_morton_layouts_match_dense) {
+  expect_layout_matches_dense<Tiled<4>>();
+  expect_layout_matches_dense<Morton<4>>();
+  expect_layout_matches_dense<Morton<>>();
+}
+
+TEST(Array2, blocked_layouts_reduce_over_cells_only) {
+  Array2<float, Tiled<8>> tiled(13, 9, -0.5, -0.5, 1.0);
+  Array2<float, Morton<4>> morton(13, 9, -0.5, -0.5, 1.0);
+  EXPECT_EQ(tiled.data.size(), 256u);
+  tiled.for_each_ij([&](int i, int j) { tiled(i, j) = 5.f + i + j; });
+  morton.for_each_ij([&](int i, int j) { morton(i, j) = -5.f - i - j; });
+  EXPECT_EQ(tiled.min(), 5.f);
+  EXPECT_EQ(tiled.max(), 25.f);
+  EXPECT_EQ(morton.max(), -5.f);
+  EXPECT_EQ(morton.infnorm(), 25.f);
+
+  /* the u grid of an n by n simulation, n + 1 by n, is not padded to the
+   * square of twice its side */
+  Array2<float, Morton<>> u(257, 256, 0, -0.5, 1.0);
+  EXPECT_LT(u.data.size(), 1.2 * u.size());
+}
+
+TEST(ScratchPool, reuses_released_buffers) {
+  ScratchPool<float> pool;
+  Array2f phi(16, 12, -0.5, -0.5, 0.1);
+  auto step = [&] {
+    auto a = pool.copy_of(phi);
+    auto b = pool.acquire(phi);
+    auto faces = pool.acquire(17, 12, 0, -0.5, 0.1);
+    EXPECT_EQ(a->data, phi.data);
+    EXPECT_NE(&*a, &*b);
+  };
+  for (int k = 0; k < 4; k++)
+    step();
+  EXPECT_EQ(pool.allocations(), 3);
+}
+
+TEST(Array2, batched_sampling_matches_value_at) {
+  Array2f u(9, 8, 0, -0.5, 0.25);
+  Array2f v(8, 9, -0.5, 0, 0.25);
+  for (int i = 0; i < u.size(); i++) {
+    u(i) = std::sin(0.37f * i);
+    v(i) = std::cos(0.23f * i);
+  }
+  BasicVelocityField<Array2f> vel(&u, &v);
+  SampleBatch batch;
+  for (float x = -0.4f; x < 2.5f; x += 0.13f) {
+    for (float y = -0.3f; y < 2.4f; y += 0.17f) {
+      batch.x.push_back(x);
+      batch.y.push_back(y);
+    }
+  }
+  std::vector<float> start_x = batch.x, start_y = batch.y;
+  int n = start_x.size();
+
+  /* values_at rounds differently from value_at, see its comment */
+  std::vector<float> values(n);
+  Array2<float, Tiled<4>> tiled(u.sx, u.sy, u.offset_x, u.offset_y, u.h);
+  tiled.for_each_ij([&](int i, int j) { tiled(i, j) = u(i, j); });
+  PaddedArray2f padded(u, 2, GhostPolicy::CLAMP);
+  PaddedArray2f periodic(u, 2, GhostPolicy::PERIODIC);
+  u.values_at(start_x.data(), start_y.data(), values.data(), n);
+  for (int k = 0; k < n; k++)
+    EXPECT_NEAR(values[k], u.value_at(batch.position(k)), 1e-5f);
+  tiled.values_at(start_x.data(), start_y.data(), values.data(), n);
+  for (int k = 0; k < n; k++)
+    EXPECT_NEAR(values[k], u.value_at(batch.position(k)), 1e-5f);
+  padded.values_at(start_x.data(), start_y.data(), values.data(), n);
+  for (int k = 0; k < n; k++)
+    EXPECT_NEAR(values[k], padded.value_at(batch.position(k)), 1e-5f);
+  periodic.values_at(start_x.data(), start_y.data(), values.data(), n);
+  for (int k = 0; k < n; k++)
+    EXPECT_NEAR(values[k], periodic.value_at(batch.position(k)), 1e-5f);
+
+  rk4_batch(vel, -0.1f, batch);
+  for (int k = 0; k < n; k++) {
+    vec2 traced = rk4(vec2(start_x[k], start_y[k]), vel, -0.1f);
+    EXPECT_NEAR(batch.x[k], traced.x, 1e-5f);
+    EXPECT_NEAR(batch.y[k], traced.y, 1e-5f);
+  }
+}
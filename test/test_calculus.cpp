@@ -4,4 +4,44 @@
 
 TEST(FirstParam, rk4) { EXPECT_EQ(1, 1); }
 
-TEST(FirstParam, forward_euler) { EXPECT_EQ(1, 1); }
\ No newline at end of file
+TEST(FirstParam, forward_euler) { EXPECT_EQ(1, 1); }
+
+/* a rigid rotation about (0.5, 0.5), linear and therefore interpolated
+ * exactly: a step of rk4 turns a point by dt radians with an error of order
+ * dt^5, and both coordinates have to move together to get there */
+TEST(Calculus, rk4_follows_a_rotation) {
+  int n = 16;
+  Array2f u(n + 1, n, 0, -0.5, 1.f / n);
+  Array2f v(n, n + 1, -0.5, 0, 1.f / n);
+  u.for_each_ij([&](int i, int j) {
+    u(i, j) = -(u.worldspace_of(i, j).y - 0.5f);
+  });
+  v.for_each_ij([&](int i, int j) {
+    v(i, j) = v.worldspace_of(i, j).x - 0.5f;
+  });
+  BasicVelocityField<Array2f> vel(&u, &v);
+  for (float dt : {0.2f, -0.3f}) {
+    for (vec2 start : {vec2(0.75f, 0.5f), vec2(0.4f, 0.3f)}) {
+      vec2 offset = start - vec2(0.5f);
+      vec2 exact = vec2(0.5f) + vec2(std::cos(dt) * offset.x -
+                                         std::sin(dt) * offset.y,
+                                     std::sin(dt) * offset.x +
+                                         std::cos(dt) * offset.y);
+      vec2 traced = rk4(start, vel, dt);
+      EXPECT_NEAR(traced.x, exact.x, 1e-5f);
+      EXPECT_NEAR(traced.y, exact.y, 1e-5f);
+    }
+  }
+}
+
+TEST(Calculus, interior_upwind_gradient_matches_checked_one) {
+  Array2f phi(6, 6, -0.5, -0.5, 0.5);
+  for (int i = 0; i < phi.size(); i++)
+    phi(i) = std::sin(0.7f * i);
+  for (vec2 velocity : {vec2(1, 1), vec2(-1, 1), vec2(1, -1), vec2(-1, -1)}) {
+    vec2 expected = upwind_gradient(phi, velocity, vec2(2, 3));
+    vec2 gradient = upwind_gradient_interior(phi, velocity, 2, 3);
+    EXPECT_EQ(gradient.x, expected.x);
+    EXPECT_EQ(gradient.y, expected.y);
+  }
+}
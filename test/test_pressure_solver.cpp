@@ -0,0 +1,407 @@
+#include "gtest/gtest.h"
+
+#include "cached_ldlt.hpp"
+#include "fast_poisson.hpp"
+#include "matrix_free.hpp"
+#include "mic_preconditioner.hpp"
+#include "multigrid.hpp"
+#include "null_space.hpp"
+#include "parallel_cg.hpp"
+#include "pressure_solver.hpp"
+#include "relaxation.hpp"
+#include <eigen3/Eigen/IterativeLinearSolvers>
+#include <eigen3/Eigen/SparseCholesky>
+
+namespace {
+
+/** builds the same negative semidefinite 5-point matrix as Simulation's
+ * poisson matrix on an n x n box of fluid, with a density jump between the
+ * lower and upper halves */
+Eigen::SparseMatrix<double> poisson_matrix(int n, double jump) {
+  std::vector<Eigen::Triplet<double>> coefficients;
+  auto beta = [&](int j) { return (j < n / 2) ? 1.0 : jump; };
+  for (int j = 0; j < n; j++) {
+    for (int i = 0; i < n; i++) {
+      int center = i + n * j;
+      double diagonal = 0;
+      for (auto o : {std::make_pair(1, 0), std::make_pair(-1, 0),
+                     std::make_pair(0, 1), std::make_pair(0, -1)}) {
+        int ni = i + o.first;
+        int nj = j + o.second;
+        if (ni < 0 || nj < 0 || ni >= n || nj >= n)
+          continue;
+        double b = (beta(j) == beta(nj))
+                       ? beta(j)
+                       : 2.0 / (1.0 / beta(j) + 1.0 / beta(nj));
+        coefficients.push_back(Eigen::Triplet<double>(center, ni + n * nj, b));
+        diagonal -= b;
+      }
+      coefficients.push_back(Eigen::Triplet<double>(center, center, diagonal));
+    }
+  }
+  Eigen::SparseMatrix<double> A(n * n, n * n);
+  A.setFromTriplets(coefficients.begin(), coefficients.end());
+  return A;
+}
+
+/** a right hand side with zero mean, so that the singular system is
+ * consistent */
+Eigen::VectorXd consistent_rhs(int size) {
+  Eigen::VectorXd b = Eigen::VectorXd::Random(size);
+  b.array() -= b.mean();
+  return b;
+}
+
+TEST(PressureSolver, mic_preconditioned_cg_converges) {
+  Eigen::SparseMatrix<double> A = poisson_matrix(32, 100.0);
+  Eigen::VectorXd b = consistent_rhs(A.rows());
+
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>,
+                           Eigen::Lower | Eigen::Upper,
+                           ModifiedIncompleteCholesky>
+      mic_solver;
+  mic_solver.setTolerance(1e-8);
+  mic_solver.compute(A);
+  Eigen::VectorXd x = mic_solver.solve(b);
+  EXPECT_LT((A * x - b).norm() / b.norm(), 1e-7);
+
+  /* the substitutions write into the same buffer every time */
+  ModifiedIncompleteCholesky &mic = mic_solver.preconditioner();
+  double const *buffer = mic.solve(b).data();
+  EXPECT_EQ(mic.solve(b).data(), buffer);
+
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>,
+                           Eigen::Lower | Eigen::Upper>
+      diagonal_solver;
+  diagonal_solver.setTolerance(1e-8);
+  diagonal_solver.compute(A);
+  x = diagonal_solver.solve(b);
+  EXPECT_LT(mic_solver.iterations(), diagonal_solver.iterations());
+}
+
+TEST(PressureSolver, projected_cg_stays_free_of_the_null_space) {
+  Eigen::SparseMatrix<double> A = poisson_matrix(32, 100.0);
+  Eigen::VectorXd b = consistent_rhs(A.rows());
+
+  Eigen::ConjugateGradient<
+      Eigen::SparseMatrix<double>, Eigen::Lower,
+      NullSpaceProjection<Eigen::DiagonalPreconditioner<double>>>
+      solver;
+  solver.preconditioner().project = true;
+  solver.setTolerance(1e-10);
+  solver.compute(A);
+  Eigen::VectorXd x = solver.solve(b);
+  EXPECT_EQ(solver.info(), Eigen::Success);
+  EXPECT_LT((A * x - b).norm() / b.norm(), 1e-9);
+  EXPECT_LT(std::abs(x.mean()), 1e-12 * x.norm());
+}
+
+TEST(PressureSolver, parallel_cg_matches_serial_result) {
+  int n = 32;
+  Eigen::SparseMatrix<double> A = poisson_matrix(n, 100.0);
+  Eigen::VectorXd b = consistent_rhs(A.rows());
+  std::vector<int> colors(n * n);
+  for (int j = 0; j < n; j++) {
+    for (int i = 0; i < n; i++)
+      colors[i + n * j] = (i + j) % 2;
+  }
+
+  ParallelConjugateGradient::Matrix rows = A;
+  Eigen::VectorXd x = Eigen::VectorXd::Zero(n * n);
+  Eigen::VectorXd threaded_x = x;
+  ParallelConjugateGradient solver;
+  solver.set_colors(colors);
+  solver.threads = 1;
+  solver.solve(rows, b, x, 1e-10, 2 * n * n);
+  EXPECT_LT((A * x - b).norm() / b.norm(), 1e-9);
+  int serial_iterations = solver.iterations;
+
+  /* red-black ordering makes the result independent of the thread count */
+  solver.threads = 4;
+  solver.solve(rows, b, threaded_x, 1e-10, 2 * n * n);
+  EXPECT_EQ(solver.iterations, serial_iterations);
+  EXPECT_LT((threaded_x - x).norm(), 1e-6 * x.norm());
+}
+
+/** a closed box of n x n cells whose outer ring is solid, with face
+ * coefficients matching poisson_matrix */
+struct BoxSystem {
+  Array2f solid_phi;
+  Array2d u_coefficients;
+  Array2d v_coefficients;
+  Array2d rhs;
+
+  BoxSystem(int n, double jump) {
+    solid_phi.init(n, n, -0.5, -0.5, 1.0);
+    u_coefficients.init(n + 1, n, 0.0, -0.5, 1.0);
+    v_coefficients.init(n, n + 1, -0.5, 0.0, 1.0);
+    rhs.init(n, n, -0.5, -0.5, 1.0);
+    solid_phi.set(0.5);
+    for (int k = 0; k < n; k++) {
+      solid_phi(k, 0) = solid_phi(k, n - 1) = -0.5;
+      solid_phi(0, k) = solid_phi(n - 1, k) = -0.5;
+    }
+    auto beta = [&](int j) { return (j < n / 2) ? 1.0 : jump; };
+    for (int j = 0; j < n; j++) {
+      for (int i = 0; i <= n; i++)
+        u_coefficients(i, j) = beta(j);
+    }
+    for (int j = 0; j <= n; j++) {
+      for (int i = 0; i < n; i++) {
+        v_coefficients(i, j) = (beta(j) == beta(j - 1))
+                                   ? beta(j)
+                                   : 2.0 / (1.0 / beta(j) + 1.0 / beta(j - 1));
+      }
+    }
+    double mean = 0;
+    int count = 0;
+    for (int j = 1; j < n - 1; j++) {
+      for (int i = 1; i < n - 1; i++) {
+        rhs(i, j) = std::sin(0.3 * i) * std::cos(0.7 * j);
+        mean += rhs(i, j);
+        count++;
+      }
+    }
+    for (int j = 1; j < n - 1; j++) {
+      for (int i = 1; i < n - 1; i++)
+        rhs(i, j) -= mean / count;
+    }
+  }
+};
+
+/** the assembled matrix of the fluid cells of box and its right hand side.
+ * The unknowns are numbered row by row into index. Cells marked in dirichlet
+ * are held at 0, so their faces only add to the diagonal. With pin, unknown 0
+ * is pinned like Simulation::pin_reference_cell does. */
+Eigen::SparseMatrix<double> box_matrix(BoxSystem const &box, Array2i &index,
+                                       Eigen::VectorXd &rhs,
+                                       Array2i const *dirichlet = nullptr,
+                                       bool pin = false) {
+  int n = box.solid_phi.sx;
+  index.init(n, n, -0.5, -0.5, 1.0);
+  int unknowns = 0;
+  index.for_each_ij([&](int i, int j) {
+    bool held = (dirichlet != nullptr && (*dirichlet)(i, j));
+    index(i, j) = (box.solid_phi(i, j) > 0 && !held) ? unknowns++ : -1;
+  });
+  std::vector<Eigen::Triplet<double>> triplets;
+  rhs.resize(unknowns);
+  index.for_each_ij([&](int i, int j) {
+    int center = index(i, j);
+    if (center < 0)
+      return;
+    std::pair<ivec2, double> faces[4] = {
+        {ivec2(i + 1, j), box.u_coefficients(i + 1, j)},
+        {ivec2(i - 1, j), box.u_coefficients(i, j)},
+        {ivec2(i, j + 1), box.v_coefficients(i, j + 1)},
+        {ivec2(i, j - 1), box.v_coefficients(i, j)}};
+    double diagonal = 0;
+    for (auto &[kl, coefficient] : faces) {
+      if (box.solid_phi(kl.x, kl.y) <= 0)
+        continue;
+      diagonal -= coefficient;
+      int neighbor = index(kl.x, kl.y);
+      if (neighbor >= 0 && !(pin && (center == 0 || neighbor == 0)))
+        triplets.push_back(
+            Eigen::Triplet<double>(center, neighbor, coefficient));
+    }
+    triplets.push_back(Eigen::Triplet<double>(center, center, diagonal));
+    rhs(center) = (pin && center == 0) ? 0 : box.rhs(i, j);
+  });
+  Eigen::SparseMatrix<double> A(unknowns, unknowns);
+  A.setFromTriplets(triplets.begin(), triplets.end());
+  return A;
+}
+
+TEST(PressureSolver, ldlt_matches_cg_and_refactorizes_only_on_change) {
+  BoxSystem box(34, 100.0);
+  Array2i index;
+  Eigen::VectorXd b;
+  Eigen::SparseMatrix<double> A = box_matrix(box, index, b, nullptr, true);
+
+  CachedLDLT ldlt;
+  ldlt.analyzePattern(A);
+  ASSERT_TRUE(ldlt.factorize(A));
+  Eigen::VectorXd x = ldlt.solve(b);
+  Eigen::ConjugateGradient<Eigen::SparseMatrix<double>,
+                           Eigen::Lower | Eigen::Upper>
+      cg;
+  cg.setTolerance(1e-12);
+  cg.compute(A);
+  Eigen::VectorXd cg_x = cg.solve(b);
+  EXPECT_LT((x - cg_x).norm(), 1e-9 * cg_x.norm());
+  EXPECT_LT((A * x - b).norm(), 1e-12 * b.norm());
+
+  /* the same values reuse the factorization, new ones are factorized */
+  ASSERT_TRUE(ldlt.factorize(A));
+  EXPECT_EQ(ldlt.factorizations, 1);
+  Eigen::SparseMatrix<double> scaled = 2.0 * A;
+  ASSERT_TRUE(ldlt.factorize(scaled));
+  EXPECT_EQ(ldlt.factorizations, 2);
+  EXPECT_LT((ldlt.solve(b) - 0.5 * x).norm(), 1e-12 * x.norm());
+
+  /* a failed factorization is not cached */
+  Eigen::SparseMatrix<double> zero = 0.0 * A;
+  EXPECT_FALSE(ldlt.factorize(zero));
+  EXPECT_FALSE(ldlt.factorize(zero));
+  EXPECT_EQ(ldlt.factorizations, 4);
+  ASSERT_TRUE(ldlt.factorize(A));
+  EXPECT_EQ(ldlt.factorizations, 5);
+}
+
+TEST(PressureSolver, multigrid_is_resolution_independent) {
+  int previous_cycles = 0;
+  for (int n : {34, 66, 130}) {
+    BoxSystem box(n, 1.0);
+    MultigridSolver multigrid;
+    multigrid.build(box.solid_phi, box.u_coefficients, box.v_coefficients);
+    Array2d x(box.rhs);
+    x.clear();
+    multigrid.solve(box.rhs, x, 1e-8, 100);
+    EXPECT_LT(multigrid.error, 1e-8);
+    EXPECT_LT(multigrid.iterations, 20);
+    if (previous_cycles > 0) {
+      EXPECT_LE(multigrid.iterations, previous_cycles + 2);
+    }
+    previous_cycles = multigrid.iterations;
+  }
+}
+
+TEST(PressureSolver, mgpcg_handles_density_jumps) {
+  for (int n : {34, 66, 130}) {
+    BoxSystem box(n, 140.0);
+    MultigridSolver multigrid;
+    multigrid.build(box.solid_phi, box.u_coefficients, box.v_coefficients);
+    Array2d x(box.rhs);
+    x.clear();
+    multigrid.solve_preconditioned_cg(box.rhs, x, 1e-8, 100);
+    EXPECT_LT(multigrid.error, 1e-8);
+    EXPECT_LT(multigrid.iterations, 20);
+  }
+}
+
+TEST(PressureSolver, multigrid_matches_a_direct_dirichlet_solve) {
+  for (int n : {34, 66}) {
+    BoxSystem box(n, 1.0);
+    Array2i dirichlet(n, n, -0.5, -0.5, 1.0);
+    for (int j = n / 2; j < n; j++) {
+      for (int i = 0; i < n; i++) {
+        dirichlet(i, j) = 1;
+        box.rhs(i, j) = 0;
+      }
+    }
+    MultigridSolver multigrid;
+    multigrid.project_null_space = false;
+    multigrid.build_hierarchy(box.solid_phi, &dirichlet);
+    multigrid.update_coefficients(box.u_coefficients, box.v_coefficients);
+    Array2d x(box.rhs);
+    x.clear();
+    multigrid.solve_preconditioned_cg(box.rhs, x, 1e-10, 100);
+    EXPECT_LT(multigrid.error, 1e-10);
+    EXPECT_LT(multigrid.iterations, 30);
+
+    /* the faces to the held cells have to act as p = 0 boundaries */
+    Array2i index;
+    Eigen::VectorXd b;
+    Eigen::SparseMatrix<double> A = box_matrix(box, index, b, &dirichlet);
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> direct(A);
+    Eigen::VectorXd expected = direct.solve(b);
+    index.for_each_ij([&](int i, int j) {
+      if (index(i, j) >= 0) {
+        EXPECT_NEAR(x(i, j), expected(index(i, j)),
+                    1e-7 * expected.lpNorm<Eigen::Infinity>());
+      }
+    });
+  }
+}
+
+TEST(PressureSolver, matrix_free_cg_converges) {
+  int n = 34;
+  BoxSystem box(n, 100.0);
+  /* the simulation leaves the faces next to a solid cell at 0 */
+  box.u_coefficients.for_each_ij([&](int i, int j) {
+    if (i < 2 || i > n - 2 || j < 1 || j > n - 2)
+      box.u_coefficients(i, j) = 0;
+  });
+  box.v_coefficients.for_each_ij([&](int i, int j) {
+    if (i < 1 || i > n - 2 || j < 2 || j > n - 2)
+      box.v_coefficients(i, j) = 0;
+  });
+  MatrixFreePoisson poisson(&box.solid_phi, &box.u_coefficients,
+                            &box.v_coefficients);
+
+  /* the operator has to be symmetric for CG */
+  Array2d x(box.rhs), y(box.rhs), ax(box.rhs), ay(box.rhs);
+  for (int i = 0; i < x.size(); i++) {
+    x(i) = std::sin(0.1 * i);
+    y(i) = std::cos(0.2 * i);
+  }
+  poisson.apply(x, ax);
+  poisson.apply(y, ay);
+  double xay = 0, yax = 0;
+  for (int i = 0; i < x.size(); i++) {
+    if (box.solid_phi(i) > 0) {
+      xay += x(i) * ay(i);
+      yax += y(i) * ax(i);
+    }
+  }
+  EXPECT_NEAR(xay, yax, 1e-9 * std::abs(xay));
+  for (int i = 0; i < ax.size(); i++) {
+    if (box.solid_phi(i) <= 0) {
+      EXPECT_EQ(ax(i), 0);
+    }
+  }
+
+  x.clear();
+  poisson.solve(box.rhs, x, 1e-10, 2 * n * n);
+  EXPECT_LT(poisson.error, 1e-10);
+  EXPECT_LT(poisson.iterations, 2 * n * n);
+}
+
+TEST(PressureSolver, sor_uses_its_sweep_budget) {
+  BoxSystem box(34, 1.0);
+  RedBlackSOR sor;
+  Array2d x(box.rhs);
+  x.clear();
+  sor.solve(box.solid_phi, box.u_coefficients, box.v_coefficients, box.rhs, x,
+            300);
+  EXPECT_EQ(sor.iterations, 300);
+  EXPECT_LT(sor.error, 1e-6);
+}
+
+TEST(PressureSolver, fft_solves_constant_coefficients_directly) {
+  for (int n : {34, 50, 66}) {
+    BoxSystem box(n, 1.0);
+    FastPoissonSolver fast_poisson;
+    ASSERT_TRUE(fast_poisson.build(box.solid_phi));
+    Array2d x(box.rhs);
+    x.clear();
+    fast_poisson.solve(box.u_coefficients, box.v_coefficients, box.rhs, x,
+                       1e-8, 100);
+    EXPECT_EQ(fast_poisson.iterations, 0);
+    EXPECT_LT(fast_poisson.error, 1e-10);
+  }
+}
+
+TEST(PressureSolver, fft_preconditions_density_jumps) {
+  BoxSystem box(50, 100.0);
+  FastPoissonSolver fast_poisson;
+  ASSERT_TRUE(fast_poisson.build(box.solid_phi));
+  Array2d x(box.rhs);
+  x.clear();
+  fast_poisson.solve(box.u_coefficients, box.v_coefficients, box.rhs, x, 1e-8,
+                     200);
+  EXPECT_LT(fast_poisson.error, 1e-8);
+  EXPECT_LT(fast_poisson.iterations, 200);
+}
+
+TEST(PressureSolver, adaptive_tolerance_loosens_for_short_substeps) {
+  double tolerance = adaptive_tolerance(1e-5, 0.01, 1e4, 10000);
+  EXPECT_NEAR(tolerance, 1e-3, 1e-12);
+  EXPECT_NEAR(adaptive_tolerance(1e-5, 0.005, 1e4, 10000), 4 * tolerance,
+              1e-12);
+  EXPECT_EQ(adaptive_tolerance(1e-5, 1.0, 1e20, 10000), 1e-10);
+  EXPECT_EQ(adaptive_tolerance(1e-5, 0.01, 0.0, 10000), 0.1);
+}
+
+} // namespace
@@ -0,0 +1,235 @@
+#include "gtest/gtest.h"
+
+#include "simulation.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+/* The global operator new of the test binary is replaced by one that counts
+ * the allocations made while counting_allocations is set, which covers every
+ * std::vector and Array2. Eigen allocates its vectors with malloc, which this
+ * does not see. */
+namespace {
+std::atomic<bool> counting_allocations{false};
+std::atomic<long> allocations{0};
+
+void *counted_allocation(std::size_t size, std::size_t alignment) {
+  if (counting_allocations)
+    allocations++;
+  size = std::max<std::size_t>(size, 1);
+  void *pointer = (alignment <= alignof(std::max_align_t))
+                      ? std::malloc(size)
+                      : std::aligned_alloc(alignment,
+                                           (size + alignment - 1) / alignment *
+                                               alignment);
+  if (!pointer)
+    throw std::bad_alloc();
+  return pointer;
+}
+} // namespace
+
+void *operator new(std::size_t size) { return counted_allocation(size, 0); }
+void *operator new[](std::size_t size) { return counted_allocation(size, 0); }
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return counted_allocation(size, static_cast<std::size_t>(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return counted_allocation(size, static_cast<std::size_t>(alignment));
+}
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+void operator delete[](void *pointer) noexcept { std::free(pointer); }
+void operator delete(void *pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+void operator delete[](void *pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+void operator delete(void *pointer, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+void operator delete[](void *pointer, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+void operator delete(void *pointer, std::size_t, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+void operator delete[](void *pointer, std::size_t, std::align_val_t) noexcept {
+  std::free(pointer);
+}
+
+namespace {
+
+/** makes sim an n x n box with solid walls and a solid block inside, water of
+ * density 1000 in the lower part and air above it, their interface crossing
+ * the cells of row 0.6 n at the height surface. With free_surface the air is
+ * held at p = 0. */
+void water_and_air(Simulation &sim, int n, bool free_surface,
+                   float surface = 0.3f) {
+  sim.init(n, n, 1.f / n, 1.f, 0.01f);
+  sim.add_fluid(1000.f);
+  sim.add_fluid(1.f);
+  sim.solid_phi.for_each_ij([&](int i, int j) {
+    bool wall = (i == 0 || j == 0 || i == n - 1 || j == n - 1);
+    bool block = (i >= n / 4 && i < n / 2 && j >= n / 4 && j < n / 3);
+    sim.solid_phi(i, j) = (wall || block) ? -0.5f * sim.h : 0.5f * sim.h;
+  });
+  float level = static_cast<int>(0.6f * n) + surface;
+  sim.fluids[0].phi.for_each_ij([&](int i, int j) {
+    sim.fluids[0].phi(i, j) = (j - level) * sim.h;
+    sim.fluids[1].phi(i, j) = (level - j) * sim.h;
+  });
+  if (free_surface)
+    sim.solver_settings.free_surface = 1;
+}
+
+/** the poisson matrix of sim built independently from its face coefficients
+ * with setFromTriplets: the coupling of two unknowns is the coefficient of
+ * their face, and the diagonal is minus the sum over all four faces, in the
+ * same order, so that faces to free surface cells only show up on it */
+Eigen::SparseMatrix<double> reference_matrix(Simulation &sim) {
+  std::vector<Eigen::Triplet<double>> triplets;
+  Array2i &cells = sim.fluid_cell_count;
+  cells.for_each_ij([&](int i, int j) {
+    int center = cells(i, j);
+    if (center < 0)
+      return;
+    std::pair<ivec2, double> faces[4] = {
+        {ivec2(i + 1, j), sim.u_coefficients(i + 1, j)},
+        {ivec2(i - 1, j), sim.u_coefficients(i, j)},
+        {ivec2(i, j + 1), sim.v_coefficients(i, j + 1)},
+        {ivec2(i, j - 1), sim.v_coefficients(i, j)}};
+    double diagonal = 0;
+    for (auto &[kl, coefficient] : faces) {
+      diagonal -= coefficient;
+      if (kl.x < 0 || kl.y < 0 || kl.x >= sim.sx || kl.y >= sim.sy ||
+          cells(kl.x, kl.y) < 0)
+        continue;
+      triplets.push_back(
+          Eigen::Triplet<double>(center, cells(kl.x, kl.y), coefficient));
+    }
+    triplets.push_back(Eigen::Triplet<double>(center, center, diagonal));
+  });
+  Eigen::SparseMatrix<double> A(sim.nf, sim.nf);
+  A.setFromTriplets(triplets.begin(), triplets.end());
+  return A;
+}
+
+TEST(Simulation, assembled_matrix_matches_triplet_reference) {
+  for (bool free_surface : {false, true}) {
+    Simulation sim;
+    water_and_air(sim, 16, free_surface);
+    sim.initialize_pressure_system();
+    sim.compute_face_coefficients(sim.u_coefficients, sim.v_coefficients);
+    sim.update_poisson_coefficients(sim.poisson_matrix);
+    Eigen::SparseMatrix<double> reference = reference_matrix(sim);
+
+    ASSERT_EQ(sim.poisson_matrix.nonZeros(), reference.nonZeros());
+    for (int c = 0; c < reference.outerSize(); c++) {
+      Eigen::SparseMatrix<double>::InnerIterator it(sim.poisson_matrix, c);
+      for (Eigen::SparseMatrix<double>::InnerIterator ref(reference, c); ref;
+           ++ref, ++it) {
+        ASSERT_TRUE(it);
+        EXPECT_EQ(it.row(), ref.row());
+        EXPECT_EQ(it.value(), ref.value());
+      }
+    }
+  }
+}
+
+TEST(Simulation, free_surface_drops_air_and_uses_ghost_fluid_faces) {
+  int n = 16;
+  int top = static_cast<int>(0.6f * n); // the highest row of water
+  for (float surface : {0.3f, 0.002f}) {
+    Simulation sim;
+    water_and_air(sim, n, true, surface);
+    sim.initialize_pressure_system();
+    sim.compute_face_coefficients(sim.u_coefficients, sim.v_coefficients);
+
+    int water_cells = 0;
+    sim.fluid_id.for_each_ij([&](int i, int j) {
+      bool water = (sim.solid_phi(i, j) > 0 && sim.fluid_id(i, j) == 0);
+      EXPECT_EQ(sim.fluid_cell_count(i, j) >= 0, water);
+      water_cells += water ? 1 : 0;
+    });
+    EXPECT_EQ(sim.nf, water_cells);
+
+    /* the faces between the water and the air above it get b / theta, theta
+     * being the fraction of the distance between the centers that is water,
+     * kept from going below 0.01 */
+    Fluid &water = sim.fluids[0];
+    Fluid &air = sim.fluids[1];
+    for (int i = 1; i < n - 1; i++) {
+      float inside = std::abs(water.phi(i, top));
+      float outside = std::abs(air.phi(i, top + 1));
+      float theta = std::max(inside / (inside + outside), 0.01f);
+      float expected = (1.f / (sim.h * sim.h)) * (1.f / (1000.f * theta));
+      EXPECT_FLOAT_EQ(sim.v_coefficients(i, top + 1), expected);
+    }
+    EXPECT_EQ(sim.v_coefficients(n / 2, top + 2), 0.0);
+  }
+}
+
+TEST(Simulation, free_surface_backends_match_a_direct_solve) {
+  int n = 16;
+  float dt = 0.01f;
+  for (PressureSolverType type :
+       {PressureSolverType::MGPCG, PressureSolverType::CG,
+        PressureSolverType::MIC_CG, PressureSolverType::LDLT}) {
+    Simulation sim;
+    water_and_air(sim, n, true);
+    sim.solver_settings.type = type;
+    sim.solver_settings.tolerance = 1e-12;
+    sim.u.for_each_ij([&](int i, int j) {
+      sim.u(i, j) = std::sin(0.7f * i) * std::cos(0.3f * j);
+    });
+    sim.v.for_each_ij([&](int i, int j) {
+      sim.v(i, j) = std::cos(0.4f * i + 0.2f * j);
+    });
+    sim.solve_pressure(dt);
+    EXPECT_EQ(sim.solver_settings.type, type);
+
+    /* the same system solved directly, from the coefficients of the solve */
+    Eigen::SparseMatrix<double> A = reference_matrix(sim);
+    Eigen::VectorXd b(sim.nf);
+    Array2i &cells = sim.fluid_cell_count;
+    cells.for_each_ij([&](int i, int j) {
+      if (cells(i, j) >= 0)
+        b(cells(i, j)) = (1.f / (sim.h * dt)) *
+                         (sim.u(i + 1, j) - sim.u(i, j) + sim.v(i, j + 1) -
+                          sim.v(i, j));
+    });
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> direct(A);
+    Eigen::VectorXd expected = direct.solve(b);
+    double scale = expected.lpNorm<Eigen::Infinity>();
+    cells.for_each_ij([&](int i, int j) {
+      float pressure = sim.p(i, j);
+      if (cells(i, j) < 0) {
+        EXPECT_EQ(pressure, 0.f);
+        return;
+      }
+      EXPECT_NEAR(pressure, expected(cells(i, j)), 1e-5 * scale)
+          << pressure_solver_name(type);
+    });
+  }
+}
+
+/* After a first substep has sized the scratch pools, the sample batch and the
+ * members of the solve, a substep that does not reseed particles allocates
+ * nothing. mgpcg keeps its vectors in the multigrid solver, where Eigen's
+ * solvers would allocate theirs in every solve. */
+TEST(Simulation, substeps_allocate_nothing_after_the_first) {
+  for (bool free_surface : {false, true}) {
+    Simulation sim;
+    water_and_air(sim, 32, free_surface);
+    sim.solver_settings.type = PressureSolverType::MGPCG;
+    sim.advance(0.002f);
+
+    allocations = 0;
+    counting_allocations = true;
+    sim.advance(0.002f);
+    counting_allocations = false;
+    EXPECT_EQ(allocations, 0) << (free_surface ? "free surface" : "closed");
+  }
+}
+
+} // namespace